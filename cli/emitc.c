@@ -0,0 +1,223 @@
+// --emit-c: translate an assembled program into a standalone C file
+// Every mailbox becomes a label, so the C compiler sees ordinary gotos and can optimize across them.
+// Mailboxes an STA can write are guarded, if they no longer hold what was translated the generated
+// program falls back to a small interpreter, same idea as the guard in the JIT.
+
+static void EmitFlush(buf* out)
+{
+	OutCallbackDefault(out->buf, out->len, 0);
+	out->len = 0;
+}
+
+static void Emit(buf* out, s8 s)
+{
+	if (out->capacity - out->len < s.len) EmitFlush(out);
+	appends8(out, s);
+}
+
+static void EmitInt(buf* out, int x)
+{
+	if (out->capacity - out->len < 12) EmitFlush(out);
+	appendInteger(out, x);
+}
+
+static void EmitLabel(buf* out, int k)
+{
+	Emit(out, S("L"));
+	EmitInt(out, k);
+}
+
+// The decimal I/O has to match InpCallbackDefault/OutCallbackDefault and the CLI error messages exactly
+static const s8 emitCPrologue = S(
+"#include <stdio.h>\n"
+"#include <stdlib.h>\n"
+"#include <limits.h>\n"
+"\n"
+"static int IsWhiteSpace(int c)\n"
+"{\n"
+"	return (c == '\\n' || c == '\\r' || c == ' ' || c == '\\t');\n"
+"}\n"
+"\n"
+"static int ReadInput(int* input)\n"
+"{\n"
+"	int c;\n"
+"	int negate = 0;\n"
+"	unsigned int value = 0;\n"
+"	unsigned int limit = INT_MAX;\n"
+"	fflush(stdout);\n"
+"	while ((c = getchar()) != EOF && IsWhiteSpace(c)) {}\n"
+"	if (c == EOF) exit(2);\n"
+"	if (c == '-') { negate = 1; limit = 0x80000000; }\n"
+"	else if (c >= '0' && c <= '9') value = c - '0';\n"
+"	else if (c != '+') goto error;\n"
+"	while ((c = getchar()) != EOF && !IsWhiteSpace(c))\n"
+"	{\n"
+"		if (c < '0' || c > '9') goto error;\n"
+"		if (value > (limit - (c - '0'))/10) goto error;\n"
+"		value = value*10 + (c - '0');\n"
+"	}\n"
+"	if (negate) value *= -1;\n"
+"	*input = value;\n"
+"	return 1;\n"
+"error:\n"
+"	while ((c = getchar()) != EOF && !IsWhiteSpace(c)) {}\n"
+"	return 0;\n"
+"}\n"
+"\n");
+
+static const s8 emitCEpilogue = S(
+"\n"
+"interpret:\n"
+"	// translated code was overwritten, run it the slow way\n"
+"	for (;;)\n"
+"	{\n"
+"		if (pc < 0 || pc > 99) goto bad_pc;\n"
+"		int v = mem[pc];\n"
+"		int opcode = v / 100;\n"
+"		int operand = v % 100;\n"
+"		if (v == 0) goto halt;\n"
+"		if (operand < 0) goto bad_instruction;\n"
+"		switch (opcode)\n"
+"		{\n"
+"			case 1: acc += mem[operand]; break;\n"
+"			case 2: acc -= mem[operand]; break;\n"
+"			case 3: mem[operand] = acc; wild |= !guarded[operand]; break;\n"
+"			case 5: acc = mem[operand]; break;\n"
+"			case 6: pc = operand - 1; break;\n"
+"			case 7: if (acc == 0) pc = operand - 1; break;\n"
+"			case 8: if ((int)acc >= 0) pc = operand - 1; break;\n"
+"			case 9:\n"
+"				if (operand == 1) { int in; while (!ReadInput(&in)) {} acc = in; }\n"
+"				else if (operand == 2) printf(\"%d\\n\", (int)acc);\n"
+"				else if (operand == 22) putchar((unsigned char)acc);\n"
+"				else goto bad_instruction;\n"
+"				break;\n"
+"			default: goto bad_instruction;\n"
+"		}\n"
+"		++pc;\n"
+"		if (!wild) goto dispatch;\n"
+"	}\n"
+"\n"
+"halt:\n"
+"	putchar('\\n');\n"
+"	return 0;\n"
+"bad_instruction:\n"
+"	printf(\"Bad instruction value %d at %d\\n\", mem[pc], pc);\n"
+"	return 0;\n"
+"bad_pc:\n"
+"	printf(\"Bad PC value %d\\n\", pc);\n"
+"	return 0;\n"
+"}\n");
+
+static void EmitC(LMCContext* code)
+{
+	unsigned char mem[1<<12];
+	buf out;
+	out.buf = &mem[0];
+	out.capacity = sizeof(mem);
+	out.len = 0;
+	out.error = 0;
+
+	// mailboxes that the program as written can store into
+	bool guarded[100] = {0};
+	for (int k = 0; k < 100; ++k)
+	{
+		int v = code->mailBoxes[k];
+		if (v / 100 == 3 && v % 100 >= 0) guarded[v % 100] = true;
+	}
+
+	Emit(&out, S("// Generated by lmcsim --emit-c\n"));
+	Emit(&out, emitCPrologue);
+
+	Emit(&out, S("static int mem[100] = {"));
+	for (int k = 0; k < 100; ++k)
+	{
+		Emit(&out, k % 10 ? S(" ") : S("\n\t"));
+		EmitInt(&out, code->mailBoxes[k]);
+		Emit(&out, S(","));
+	}
+	Emit(&out, S("\n};\n\nstatic const unsigned char guarded[100] = {"));
+	for (int k = 0; k < 100; ++k)
+	{
+		Emit(&out, k % 10 ? S(" ") : S("\n\t"));
+		Emit(&out, guarded[k] ? S("1,") : S("0,"));
+	}
+	Emit(&out, S("\n};\n\nint main(void)\n{\n\tunsigned int acc = 0;\n\tint pc = 0;\n\tint wild = 0;\n\tgoto L0;\n\n"));
+
+	Emit(&out, S("dispatch:\n\tswitch (pc)\n\t{\n"));
+	for (int k = 0; k < 100; ++k)
+	{
+		Emit(&out, S("\t\tcase "));
+		EmitInt(&out, k);
+		Emit(&out, S(": goto "));
+		EmitLabel(&out, k);
+		Emit(&out, S(";\n"));
+	}
+	Emit(&out, S("\t\tdefault: goto bad_pc;\n\t}\n\n"));
+
+	for (int k = 0; k < 100; ++k)
+	{
+		int v = code->mailBoxes[k];
+		int opcode = v / 100;
+		int operand = v % 100;
+
+		EmitLabel(&out, k);
+		Emit(&out, S(":\n"));
+		if (guarded[k])
+		{
+			Emit(&out, S("\tif (mem["));
+			EmitInt(&out, k);
+			Emit(&out, S("] != "));
+			EmitInt(&out, v);
+			Emit(&out, S(") { pc = "));
+			EmitInt(&out, k);
+			Emit(&out, S("; goto interpret; }\n"));
+		}
+
+		if (v == 0)
+		{
+			opcode = 0;
+		}
+		else if (operand < 0 || opcode < 1 || opcode == 4 || opcode > 9
+			|| (opcode == 9 && operand != 1 && operand != 2 && operand != 22))
+		{
+			opcode = -1;
+		}
+
+		switch (opcode)
+		{
+			case 0:
+			case -1:
+				Emit(&out, S("\tpc = "));
+				EmitInt(&out, k);
+				Emit(&out, opcode == 0 ? S("; goto halt;\n") : S("; goto bad_instruction;\n"));
+				continue;
+			case 1: Emit(&out, S("\tacc += mem[")); break;
+			case 2: Emit(&out, S("\tacc -= mem[")); break;
+			case 3: Emit(&out, S("\tmem[")); break;
+			case 5: Emit(&out, S("\tacc = mem[")); break;
+			case 6:
+				Emit(&out, S("\tgoto "));
+				EmitLabel(&out, operand);
+				Emit(&out, S(";\n"));
+				continue;
+			case 7:
+			case 8:
+				Emit(&out, opcode == 7 ? S("\tif (acc == 0) goto ") : S("\tif ((int)acc >= 0) goto "));
+				EmitLabel(&out, operand);
+				Emit(&out, S(";\n"));
+				continue;
+			case 9:
+				if (operand == 1) Emit(&out, S("\t{ int in; while (!ReadInput(&in)) {} acc = in; }\n"));
+				else if (operand == 2) Emit(&out, S("\tprintf(\"%d\\n\", (int)acc);\n"));
+				else Emit(&out, S("\tputchar((unsigned char)acc);\n"));
+				continue;
+		}
+		EmitInt(&out, operand);
+		Emit(&out, opcode == 3 ? S("] = acc;\n") : S("];\n"));
+	}
+	Emit(&out, S("\tpc = 100;\n\tgoto bad_pc;\n"));
+
+	Emit(&out, emitCEpilogue);
+	EmitFlush(&out);
+}
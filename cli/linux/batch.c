@@ -0,0 +1,542 @@
+// --batch: run a manifest of jobs across all cores
+// Manifest lines are "program input [expected]", # starts a comment line.
+// Every program is assembled once up front, then the jobs are split into one queue per worker.
+// Workers run their own queue front to back and steal from the back of other queues once it's empty.
+// Each job prints one JSON line with its status, step count and wall time.
+// Jobs with the same image and input as an earlier one reuse its result, see resultcache.c
+// With --coverage, jobs run with RunCovered() into bitmaps owned by their worker, one per program, and the
+// workers merge them when they finish. A line per program then says which of its source lines ever ran.
+// RunDetectLoops() doesn't collect coverage, so --coverage can't be combined with --detect-loops.
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct
+{
+	char* program;
+	char* input;
+	char* expected; // null if the output isn't checked
+	int programIndex;
+} BatchJob;
+
+typedef struct
+{
+	char* path;
+	LMCContext image;
+	int errorLine; // -1 if it assembled
+	s8 errorMessage;
+	int lines[100]; // source line of each mailbox, 0 if none
+	LMCCoverage coverage; // merged from every worker once they're done
+} BatchProgram;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	int head;
+	int tail; // jobs [head, tail) are still waiting
+} JobQueue;
+
+typedef struct
+{
+	BatchJob* jobs;
+	BatchProgram* programs;
+	JobQueue* queues;
+	int workerCount;
+	long maxSteps;
+	bool detectLoops; // stop provably infinite loops early, instead of running them to maxSteps
+	bool coverage;
+	int programCount;
+	ptrdiff_t outputLimit;
+	pthread_mutex_t outputLock;
+	ResultCache cache;
+} Batch;
+
+typedef struct
+{
+	Batch* batch;
+	int id;
+} BatchWorker;
+
+static long NowMicroseconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000000L + ts.tv_nsec/1000;
+}
+
+// Owner takes from the front, so it runs the jobs of one program back to back and the JIT code stays warm
+static int JobQueuePopFront(JobQueue* queue)
+{
+	int job = -1;
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head < queue->tail) job = queue->head++;
+	pthread_mutex_unlock(&queue->lock);
+	return job;
+}
+
+static int JobQueuePopBack(JobQueue* queue)
+{
+	int job = -1;
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head < queue->tail) job = --queue->tail;
+	pthread_mutex_unlock(&queue->lock);
+	return job;
+}
+
+static int BatchNextJob(Batch* batch, int id)
+{
+	int job = JobQueuePopFront(&batch->queues[id]);
+	for (int i = 1; job == -1 && i < batch->workerCount; ++i)
+	{
+		job = JobQueuePopBack(&batch->queues[(id + i) % batch->workerCount]);
+	}
+	return job;
+}
+
+// EOF shows up as bad input, the job loop checks result to tell them apart
+typedef struct
+{
+	InputReader reader;
+	ReadResult result; // of the last read
+} BatchInput;
+
+static bool InpCallbackBatch(int* input, void* ctx)
+{
+	BatchInput* in = ctx;
+	in->result = ReadInteger(&in->reader, input);
+	return in->result == READ_OK;
+}
+
+static void OutCallbackCapture(unsigned char* str, ptrdiff_t len, void* ctx)
+{
+	append(ctx, str, len);
+}
+
+static void appendJsonString(buf* buffer, s8 s)
+{
+	appendChar(buffer, '"');
+	for (ptrdiff_t i = 0; i < s.len; ++i)
+	{
+		unsigned char c = s.str[i];
+		if (c == '"' || c == '\\')
+		{
+			appendChar(buffer, '\\');
+			appendChar(buffer, c);
+		}
+		else if (c < 0x20)
+		{
+			appends8(buffer, S("\\u00"));
+			appendChar(buffer, "0123456789abcdef"[c >> 4]);
+			appendChar(buffer, "0123456789abcdef"[c & 15]);
+		}
+		else appendChar(buffer, c);
+	}
+	appendChar(buffer, '"');
+}
+
+// s8FileMap() can't map an empty file, so that's told apart from a missing one here
+static bool BatchFileMap(const char* path, s8* contents)
+{
+	*contents = s8FileMap(path);
+	if (contents->str) return true;
+	struct stat stbuf;
+	return stat(path, &stbuf) == 0 && S_ISREG(stbuf.st_mode) && stbuf.st_size == 0;
+}
+
+static void BatchFlushLines(Batch* batch, buf* lines)
+{
+	pthread_mutex_lock(&batch->outputLock);
+	OutCallbackDefault(lines->buf, lines->len, 0);
+	pthread_mutex_unlock(&batch->outputLock);
+	lines->len = 0;
+}
+
+// coverage is the worker's own, one per program, null if it isn't being collected
+static void BatchRunJob(Batch* batch, LMCJit* jit, buf* output, buf* lines, LMCCoverage* coverage, int jobIndex)
+{
+	BatchJob* job = &batch->jobs[jobIndex];
+	BatchProgram* program = &batch->programs[job->programIndex];
+	long start = NowMicroseconds();
+
+	s8 status = S("ran");
+	s8 termination = S("");
+	long steps = 0;
+	bool cached = false;
+	s8 input;
+
+	if (program->errorLine == -2)
+	{
+		status = S("missing_program");
+	}
+	else if (program->errorLine != -1)
+	{
+		status = S("assemble_error");
+	}
+	else if (!BatchFileMap(job->input, &input))
+	{
+		status = S("missing_input");
+	}
+	else
+	{
+		ResultKey key = ResultKeyFor(&program->image, input, batch->maxSteps, batch->detectLoops, batch->coverage);
+		RuntimeError error;
+		LMCCoverage reached = {{0, 0}};
+		cached = ResultCacheFind(&batch->cache, key, output, &error, &steps, &reached);
+		if (!cached)
+		{
+			BatchInput in;
+			InputReaderInitMemory(&in.reader, input);
+			in.result = READ_OK;
+			output->len = 0;
+			output->error = false;
+
+			LMCContext x = program->image;
+			x.inpFunction = InpCallbackBatch;
+			x.inputCtx = &in;
+			x.outFunction = OutCallbackCapture;
+			x.outputCtx = output;
+
+			while (true)
+			{
+				long ran = 0;
+				if (coverage) error = RunCovered(&x, &reached, batch->maxSteps - steps, &ran);
+				else if (batch->detectLoops) error = RunDetectLoops(&x, batch->maxSteps - steps, &ran);
+				else error = JitRun(jit, &x, batch->maxSteps - steps, &ran);
+				steps += ran;
+				if (error != ERROR_BAD_INPUT || in.result == READ_EOF) break;
+				// same as the CLI: report it, and the INP tries the next one
+				unsigned char mem[64];
+				Arena arena = { &mem[0], &mem[sizeof(mem)] };
+				appends8(output, RuntimeError_StrErrorArena(&x, error, &arena));
+			}
+
+			// the CLI exits without a message when input runs out, and prints nothing past a runaway program
+			if (error != ERROR_BUDGET_EXHAUSTED && error != ERROR_BAD_INPUT)
+			{
+				unsigned char mem[64];
+				Arena arena = { &mem[0], &mem[sizeof(mem)] };
+				appends8(output, RuntimeError_StrErrorArena(&x, error, &arena));
+				appendChar(output, '\n');
+			}
+			ResultCacheStore(&batch->cache, key, output, error, steps, reached);
+		}
+		s8FileUnmap(input);
+		if (coverage)
+		{
+			coverage[job->programIndex].bits[0] |= reached.bits[0];
+			coverage[job->programIndex].bits[1] |= reached.bits[1];
+		}
+
+		switch (error)
+		{
+			case ERROR_OK: break; // Step() only
+			case ERROR_BUDGET_EXHAUSTED: termination = S("step_limit"); break;
+			case ERROR_INFINITE_LOOP: termination = S("infinite_loop"); break;
+			case ERROR_HALT: termination = S("halt"); break;
+			case ERROR_BAD_PC: termination = S("bad_pc"); break;
+			case ERROR_BAD_INSTRUCTION: termination = S("bad_instruction"); break;
+			case ERROR_BAD_INPUT: termination = S("input_eof"); break;
+			case ERROR_VALUE_OVERFLOW: termination = S("value_overflow"); break;
+			case ERROR_NEED_INPUT: termination = S("need_input"); break;
+		}
+		if (job->expected)
+		{
+			s8 expected;
+			if (BatchFileMap(job->expected, &expected))
+			{
+				bool pass = !output->error && s8Equal(bufTos8(output), expected);
+				s8FileUnmap(expected);
+				status = pass ? S("pass") : S("fail");
+			}
+			else status = S("missing_expected");
+		}
+	}
+
+	long elapsed = NowMicroseconds() - start;
+
+	// longest line is bounded by the paths, make room for it before appending
+	ptrdiff_t need = 256 + 6*(strlen(job->program) + strlen(job->input) + program->errorMessage.len);
+	if (lines->capacity - lines->len < need) BatchFlushLines(batch, lines);
+
+	appends8(lines, S("{\"job\":"));
+	appendInteger(lines, jobIndex);
+	appends8(lines, S(",\"program\":"));
+	appendJsonString(lines, s8FromCString(job->program));
+	appends8(lines, S(",\"input\":"));
+	appendJsonString(lines, s8FromCString(job->input));
+	appends8(lines, S(",\"status\":\""));
+	appends8(lines, status);
+	appendChar(lines, '"');
+	if (termination.len)
+	{
+		appends8(lines, S(",\"termination\":\""));
+		appends8(lines, termination);
+		appendChar(lines, '"');
+	}
+	if (program->errorLine >= 0)
+	{
+		appends8(lines, S(",\"line\":"));
+		appendInteger(lines, program->errorLine);
+		appends8(lines, S(",\"message\":"));
+		appendJsonString(lines, program->errorMessage);
+	}
+	appends8(lines, S(",\"steps\":"));
+	appendLong(lines, steps);
+	if (cached) appends8(lines, S(",\"cached\":true"));
+	appends8(lines, S(",\"wall_us\":"));
+	appendLong(lines, elapsed);
+	appends8(lines, S("}\n"));
+}
+
+static void* BatchWorkerMain(void* arg)
+{
+	BatchWorker* worker = arg;
+	Batch* batch = worker->batch;
+	LMCJit* jit = JitCreate();
+
+	buf output;
+	output.buf = malloc(batch->outputLimit);
+	output.capacity = batch->outputLimit;
+	output.len = 0;
+	output.error = 0;
+
+	unsigned char lineMem[1<<16];
+	buf lines;
+	lines.buf = &lineMem[0];
+	lines.capacity = sizeof(lineMem);
+	lines.len = 0;
+	lines.error = 0;
+
+	// whole cache lines, so no two workers' bitmaps share one
+	LMCCoverage* coverage = 0;
+	size_t coverageSize = (batch->programCount * sizeof(LMCCoverage) + 63) & ~(size_t)63;
+	if (batch->coverage)
+	{
+		coverage = aligned_alloc(64, coverageSize);
+		if (coverage) memset(coverage, 0, coverageSize);
+	}
+
+	if (output.buf && (coverage || !batch->coverage))
+	{
+		int job;
+		while ((job = BatchNextJob(batch, worker->id)) != -1)
+		{
+			BatchRunJob(batch, jit, &output, &lines, coverage, job);
+		}
+	}
+	BatchFlushLines(batch, &lines);
+
+	if (coverage)
+	{
+		pthread_mutex_lock(&batch->outputLock);
+		for (int i = 0; i < batch->programCount; ++i)
+		{
+			batch->programs[i].coverage.bits[0] |= coverage[i].bits[0];
+			batch->programs[i].coverage.bits[1] |= coverage[i].bits[1];
+		}
+		pthread_mutex_unlock(&batch->outputLock);
+	}
+	free(coverage);
+
+	free(output.buf);
+	JitDestroy(jit);
+	return 0;
+}
+
+static void appendLineList(buf* buffer, const int* lines, const bool* pick)
+{
+	appendChar(buffer, '[');
+	bool first = true;
+	for (int i = 0; i < 100; ++i)
+	{
+		if (!pick[i]) continue;
+		if (!first) appendChar(buffer, ',');
+		appendInteger(buffer, lines[i]);
+		first = false;
+	}
+	appendChar(buffer, ']');
+}
+
+// One JSON line per program that assembled. Lines that never ran are only listed as uncovered if they
+// look like code: a mailbox some LDA/ADD/SUB/STA in the program uses is data, and a DAT isn't dead code
+static void PrintCoverage(BatchProgram* program)
+{
+	bool data[100] = {0};
+	for (int i = 0; i < 100; ++i)
+	{
+		int opcode = program->image.mailBoxes[i] / 100;
+		if (program->image.mailBoxes[i] > 0 && (opcode == 1 || opcode == 2 || opcode == 3 || opcode == 5))
+			data[program->image.mailBoxes[i] % 100] = true;
+	}
+
+	bool covered[100], uncovered[100];
+	int coveredCount = 0, lineCount = 0;
+	for (int i = 0; i < 100; ++i)
+	{
+		bool reached = (program->coverage.bits[i / 64] >> (i % 64)) & 1;
+		covered[i] = program->lines[i] && reached;
+		uncovered[i] = program->lines[i] && !reached && !data[i];
+		coveredCount += covered[i];
+		lineCount += covered[i] || uncovered[i];
+	}
+
+	int capacity = 1024 + 6*(int)strlen(program->path);
+	buf line = { malloc(capacity), capacity, 0, false };
+	if (!line.buf) return;
+	appends8(&line, S("{\"coverage\":"));
+	appendJsonString(&line, s8FromCString(program->path));
+	appends8(&line, S(",\"lines\":"));
+	appendInteger(&line, lineCount);
+	appends8(&line, S(",\"covered\":"));
+	appendInteger(&line, coveredCount);
+	appends8(&line, S(",\"covered_lines\":"));
+	appendLineList(&line, program->lines, covered);
+	appends8(&line, S(",\"uncovered_lines\":"));
+	appendLineList(&line, program->lines, uncovered);
+	appends8(&line, S("}\n"));
+	OutCallbackDefault(line.buf, line.len, 0);
+	free(line.buf);
+}
+
+static bool IsManifestSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Splits the next whitespace separated word off line, NUL terminating it in place
+static char* ManifestWord(char** line)
+{
+	char* s = *line;
+	while (IsManifestSpace(*s)) ++s;
+	if (!*s) return 0;
+	char* word = s;
+	while (*s && !IsManifestSpace(*s)) ++s;
+	if (*s) *s++ = 0;
+	*line = s;
+	return word;
+}
+
+static int RunBatch(char* manifestName, int workerCount, long maxSteps, bool detectLoops, bool coverage, char* cacheDirectory)
+{
+	s8 manifest = s8FileMap(manifestName);
+	if (!manifest.str) return 1;
+
+	// a NUL terminated copy, so paths can point straight into it
+	char* text = malloc(manifest.len + 1);
+	if (!text) return 1;
+	memcpy(text, manifest.str, manifest.len);
+	text[manifest.len] = 0;
+	s8FileUnmap(manifest);
+
+	int lineCount = 1;
+	for (ptrdiff_t i = 0; i < manifest.len; ++i) lineCount += text[i] == '\n';
+
+	BatchJob* jobs = malloc(lineCount * sizeof(BatchJob));
+	BatchProgram* programs = malloc(lineCount * sizeof(BatchProgram));
+	if (!jobs || !programs) return 1;
+	int jobCount = 0;
+	int programCount = 0;
+
+	// assembler messages for the whole batch
+	ptrdiff_t messageSize = 1<<20;
+	unsigned char* messageMem = malloc(messageSize);
+	if (!messageMem) return 1;
+	Arena messages = { messageMem, messageMem + messageSize };
+
+	for (char* line = text; line;)
+	{
+		char* next = strchr(line, '\n');
+		if (next) *next++ = 0;
+
+		char* programName = ManifestWord(&line);
+		char* input = programName ? ManifestWord(&line) : 0;
+		char* expected = input ? ManifestWord(&line) : 0;
+		line = next;
+
+		if (!programName || programName[0] == '#') continue;
+		if (!input) return 1;
+
+		BatchJob* job = &jobs[jobCount++];
+		job->program = programName;
+		job->input = input;
+		job->expected = expected;
+
+		// manifests usually list all the tests of a program together, so check the last one first
+		int index = programCount - 1;
+		if (index < 0 || strcmp(programs[index].path, programName) != 0)
+		{
+			for (index = 0; index < programCount; ++index)
+			{
+				if (strcmp(programs[index].path, programName) == 0) break;
+			}
+		}
+		if (index == programCount)
+		{
+			BatchProgram* program = &programs[programCount++];
+			program->path = programName;
+			program->image = (LMCContext){0};
+			program->errorLine = -2; // unreadable file
+			program->errorMessage = (s8){ 0, 0 };
+			memset(program->lines, 0, sizeof(program->lines));
+			program->coverage = (LMCCoverage){{0, 0}};
+			s8 source = s8FileMap(programName);
+			if (source.str)
+			{
+				AssemblerError error = LoadProgram(programName, source, &program->image, &messages, program->lines);
+				program->errorLine = error.lineNumber;
+				program->errorMessage = error.message;
+				s8FileUnmap(source);
+			}
+		}
+		job->programIndex = index;
+	}
+
+	if (workerCount > jobCount) workerCount = jobCount;
+	if (workerCount < 1) workerCount = 1;
+
+	Batch batch;
+	batch.jobs = jobs;
+	batch.programs = programs;
+	batch.workerCount = workerCount;
+	batch.maxSteps = maxSteps;
+	batch.detectLoops = detectLoops;
+	batch.coverage = coverage;
+	batch.programCount = programCount;
+	batch.outputLimit = 1<<20;
+	if (!ResultCacheInit(&batch.cache, jobCount, cacheDirectory)) return 1;
+	batch.queues = malloc(workerCount * sizeof(JobQueue));
+	pthread_t* threads = malloc(workerCount * sizeof(pthread_t));
+	BatchWorker* workers = malloc(workerCount * sizeof(BatchWorker));
+	if (!batch.queues || !threads || !workers) return 1;
+	pthread_mutex_init(&batch.outputLock, 0);
+
+	// contiguous slices, so each worker starts on whole programs
+	for (int i = 0; i < workerCount; ++i)
+	{
+		pthread_mutex_init(&batch.queues[i].lock, 0);
+		batch.queues[i].head = (int)((long)jobCount * i / workerCount);
+		batch.queues[i].tail = (int)((long)jobCount * (i+1) / workerCount);
+		workers[i].batch = &batch;
+		workers[i].id = i;
+	}
+
+	int started = 0;
+	for (; started < workerCount; ++started)
+	{
+		if (pthread_create(&threads[started], 0, BatchWorkerMain, &workers[started]) != 0) break;
+	}
+	// couldn't start any threads, still do the work
+	if (started == 0) BatchWorkerMain(&workers[0]);
+	for (int i = 0; i < started; ++i)
+	{
+		pthread_join(threads[i], 0);
+	}
+
+	for (int i = 0; coverage && i < programCount; ++i)
+	{
+		if (programs[i].errorLine == -1) PrintCoverage(&programs[i]);
+	}
+
+	return 0;
+}
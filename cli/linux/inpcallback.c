@@ -3,6 +3,10 @@
 #include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 static bool IsDigit(char c)
 {
@@ -14,23 +18,94 @@ static bool IsWhiteSpace(char c)
 	return (c == '\n' || c == '\r' || c == ' ' || c == '\t');
 }
 
-static bool InpCallbackDefault(int* input, void* ctx)
+// Block reader for stdin, so parsing a number doesn't cost a read() per byte.
+// If stdin is a regular file it's mapped instead, and never needs refilling.
+typedef struct
+{
+	unsigned char* buf;
+	ptrdiff_t capacity;
+	ptrdiff_t len;
+	ptrdiff_t pos;
+	OutputBuffer* tie; // flushed before blocking on stdin, so prompts show up. Can be null
+} InputReader;
+
+// Reader over input that's already in memory, hits EOF at the end instead of reading stdin
+static void InputReaderInitMemory(InputReader* reader, s8 input)
+{
+	reader->buf = input.str;
+	reader->capacity = 0;
+	reader->len = input.len;
+	reader->pos = 0;
+	reader->tie = 0;
+}
+
+static void InputReaderInit(InputReader* reader, unsigned char* mem, ptrdiff_t capacity, OutputBuffer* tie)
+{
+	reader->buf = mem;
+	reader->capacity = capacity;
+	reader->len = 0;
+	reader->pos = 0;
+	reader->tie = tie;
+
+	struct stat stbuf;
+	if (fstat(STDIN_FILENO, &stbuf) == -1 || !S_ISREG(stbuf.st_mode) || stbuf.st_size == 0)
+		return;
+
+	// already at the end, or the file shrank under us - read() gets EOF (or whatever gets appended) right
+	off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+	if (offset == -1 || offset >= stbuf.st_size) return;
+
+	void* contents = mmap(0, stbuf.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+	if (contents == MAP_FAILED) return;
+
+	reader->buf = contents;
+	reader->capacity = 0; // nothing to refill into
+	reader->len = stbuf.st_size;
+	reader->pos = offset;
+}
+
+// returns the next byte of stdin, or -1 at EOF
+static int ReaderNext(InputReader* reader)
+{
+	if (reader->pos == reader->len)
+	{
+		if (reader->capacity == 0) return -1;
+
+		OutFlush(reader->tie);
+		ssize_t bytesRead;
+		do
+		{
+			bytesRead = read(STDIN_FILENO, reader->buf, reader->capacity);
+		} while (bytesRead < 0 && errno == EINTR);
+
+		if (bytesRead <= 0) return -1;
+		reader->len = bytesRead;
+		reader->pos = 0;
+	}
+	return reader->buf[reader->pos++];
+}
+
+typedef enum
+{
+	READ_OK,
+	READ_BAD, // not an integer, or overflowed
+	READ_EOF, // nothing but whitespace left
+} ReadResult;
+
+// Same rules as s8ToInteger: optional sign, then digits up to the next whitespace, overflow is an error
+static ReadResult ReadInteger(InputReader* reader, int* input)
 {
-	(void) ctx; // unused since reading from stdin
-	char digit;
+	int digit;
 
 	bool negate = false;
 	unsigned int value = 0;
 	unsigned int limit = INT_MAX;
-	int bytesRead;
 
 	// Consume all whitespace, up until the first non-whitespace
-	while ((bytesRead = read(STDIN_FILENO, &digit, 1) > 0) && IsWhiteSpace(digit)){}
+	while ((digit = ReaderNext(reader)) != -1 && IsWhiteSpace(digit)){}
 
-	// EOF, from pipe
-	// not possible to do anything useful
-	if (bytesRead == 0)
-		exit(2);
+	if (digit == -1)
+		return READ_EOF;
 
 	switch (digit)
 	{
@@ -48,7 +123,7 @@ static bool InpCallbackDefault(int* input, void* ctx)
 			value += digit - '0';
 			break;
 	}
-	while ((bytesRead = read(STDIN_FILENO, &digit, 1) > 0))
+	while ((digit = ReaderNext(reader)) != -1)
 	{
 		if (IsWhiteSpace(digit))
 		{
@@ -72,11 +147,27 @@ static bool InpCallbackDefault(int* input, void* ctx)
 
 	if (negate) value *= -1;
 	*input = value;
-	return true;
+	return READ_OK;
 
 error:
-			while ((bytesRead = read(STDIN_FILENO, &digit, 1) > 0) && !IsWhiteSpace(digit)){}
-			return false;
+			while ((digit = ReaderNext(reader)) != -1 && !IsWhiteSpace(digit)){}
+			return READ_BAD;
+}
+
+// ctx is an InputReader*
+static bool InpCallbackDefault(int* input, void* ctx)
+{
+	InputReader* reader = ctx;
+	ReadResult result = ReadInteger(reader, input);
+
+	// EOF, from pipe
+	// not possible to do anything useful
+	if (result == READ_EOF)
+	{
+		OutFlush(reader->tie);
+		exit(2);
+	}
+	return result == READ_OK;
 }
 
 /*
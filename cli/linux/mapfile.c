@@ -5,7 +5,7 @@
 #include <unistd.h>
 
 // returns the contents of file
-// No unmap function because I really don't care if it leaks
+// Leaking it is fine for one-off use, s8FileUnmap is there for callers that map many files
 static s8 s8FileMap(const char* fileName)
 {
 	s8 contents = (s8) { 0, 0 };
@@ -35,3 +35,9 @@ static s8 s8FileMap(const char* fileName)
 
 	return contents;
 }
+
+// For callers that map many files, like --batch
+static void s8FileUnmap(s8 contents)
+{
+	if (contents.str) munmap(contents.str, contents.len);
+}
@@ -2,14 +2,20 @@
 #include <stddef.h>
 #include <stdlib.h>
 
-void OutCallbackDefault(unsigned char* str, ptrdiff_t len, void* ctx)
+// Output sink for OutCallbackDefault, so OUT/OTC don't cost a syscall each
+// The owner flushes it before reading input, and when the program stops
+typedef struct
 {
-	// Just writing to stdout, don't need ctx
-	(void) ctx;
+	unsigned char* buf;
+	ptrdiff_t capacity;
+	ptrdiff_t len;
+} OutputBuffer;
 
-	for (int offset = 0; offset < len;)
+static void WriteAll(unsigned char* str, ptrdiff_t len)
+{
+	for (ptrdiff_t offset = 0; offset < len;)
 	{
-		int ret = write(STDOUT_FILENO, str, len);
+		ssize_t ret = write(STDOUT_FILENO, str + offset, len - offset);
 		if (ret < 0)
 		{
 			exit(2);
@@ -18,3 +24,37 @@ void OutCallbackDefault(unsigned char* str, ptrdiff_t len, void* ctx)
 	}
 }
 
+static void OutFlush(OutputBuffer* out)
+{
+	if (!out) return;
+	WriteAll(out->buf, out->len);
+	out->len = 0;
+}
+
+// ctx is an OutputBuffer*, or null to write straight to stdout
+void OutCallbackDefault(unsigned char* str, ptrdiff_t len, void* ctx)
+{
+	OutputBuffer* out = ctx;
+	if (!out)
+	{
+		WriteAll(str, len);
+		return;
+	}
+
+	if (out->capacity - out->len < len)
+	{
+		OutFlush(out);
+		// wouldn't fit even in an empty buffer
+		if (len > out->capacity)
+		{
+			WriteAll(str, len);
+			return;
+		}
+	}
+
+	for (ptrdiff_t i = 0; i < len; ++i)
+	{
+		out->buf[out->len + i] = str[i];
+	}
+	out->len += len;
+}
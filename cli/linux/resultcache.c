@@ -0,0 +1,244 @@
+// Result cache for --batch, keyed by the assembled image and the input
+// Assemble() already throws away comments, whitespace and label names, so resubmissions that only change
+// those come out as the same image and share results. The key also covers the step limit, loop detection
+// and whether coverage was collected, since those change how a run can end or what it records. Results
+// live in a hash table shared by the workers, and optionally in a directory (--cache DIR) with one file
+// per key, so later batches hit them too.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// 128 bits from two unrelated hashes, so a collision isn't a practical concern
+typedef struct
+{
+	unsigned long long a;
+	unsigned long long b;
+} ResultKey;
+
+typedef struct
+{
+	ResultKey key;
+	bool used;
+	bool truncated; // output hit the batch output limit
+	RuntimeError termination;
+	long steps;
+	LMCCoverage coverage; // zero unless the run collected it
+	unsigned char* output;
+	int outputLength;
+} CachedResult;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	CachedResult* slots;
+	int capacity; // power of two, at least twice the number of jobs so it never fills up
+	char* directory; // null for memory only
+} ResultCache;
+
+#define LMC_RESULT_VERSION 1
+
+// what a result file starts with, followed by the output
+typedef struct
+{
+	char magic[4]; // "LMCR"
+	unsigned int version;
+	int termination;
+	long steps;
+	int truncated;
+	int outputLength;
+	LMCCoverage coverage;
+} ResultFileHeader;
+
+static void ResultKeyAdd(ResultKey* key, const void* data, ptrdiff_t len)
+{
+	const unsigned char* p = data;
+	for (ptrdiff_t i = 0; i < len; ++i)
+	{
+		key->a = (key->a ^ p[i]) * 0x100000001B3ull; // FNV-1a
+		key->b = ((key->b << 5 | key->b >> 59) ^ p[i]) * 0x9E3779B97F4A7C15ull;
+	}
+}
+
+static ResultKey ResultKeyFor(const LMCContext* image, s8 input, long maxSteps, bool detectLoops, bool coverage)
+{
+	ResultKey key = { 0xCBF29CE484222325ull, 0x2545F4914F6CDD1Dull };
+	ResultKeyAdd(&key, image->mailBoxes, sizeof(image->mailBoxes));
+	ResultKeyAdd(&key, &image->accumulator, sizeof(image->accumulator));
+	ResultKeyAdd(&key, &image->programCounter, sizeof(image->programCounter));
+	ResultKeyAdd(&key, &maxSteps, sizeof(maxSteps));
+	ResultKeyAdd(&key, &detectLoops, sizeof(detectLoops));
+	ResultKeyAdd(&key, &coverage, sizeof(coverage));
+	// the length separates the input from everything before it
+	ResultKeyAdd(&key, &input.len, sizeof(input.len));
+	ResultKeyAdd(&key, input.str, input.len);
+	return key;
+}
+
+static bool ResultCacheInit(ResultCache* cache, int jobCount, char* directory)
+{
+	int capacity = 16;
+	while (capacity < 2*jobCount) capacity *= 2;
+	cache->slots = calloc(capacity, sizeof(CachedResult));
+	if (!cache->slots) return false;
+	cache->capacity = capacity;
+	cache->directory = directory;
+	pthread_mutex_init(&cache->lock, 0);
+	return true;
+}
+
+// Slot for key, empty if it isn't there. Call with the lock held
+static CachedResult* ResultCacheSlot(ResultCache* cache, ResultKey key)
+{
+	int mask = cache->capacity - 1;
+	for (int i = (int)(key.a & mask);; i = (i+1) & mask)
+	{
+		CachedResult* slot = &cache->slots[i];
+		if (!slot->used || (slot->key.a == key.a && slot->key.b == key.b)) return slot;
+	}
+}
+
+static void ResultCacheInsert(ResultCache* cache, ResultKey key, s8 output, bool truncated, RuntimeError termination, long steps, LMCCoverage coverage)
+{
+	unsigned char* copy = malloc(output.len ? output.len : 1);
+	if (!copy) return;
+	memcpy(copy, output.str, output.len);
+
+	pthread_mutex_lock(&cache->lock);
+	CachedResult* slot = ResultCacheSlot(cache, key);
+	if (slot->used)
+	{
+		// another worker ran the same job at the same time
+		pthread_mutex_unlock(&cache->lock);
+		free(copy);
+		return;
+	}
+	slot->key = key;
+	slot->used = true;
+	slot->truncated = truncated;
+	slot->termination = termination;
+	slot->steps = steps;
+	slot->coverage = coverage;
+	slot->output = copy;
+	slot->outputLength = (int)output.len;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+// DIR/<32 hex digits of the key>, NUL terminated
+static void ResultFilePath(buf* path, char* directory, ResultKey key)
+{
+	appends8(path, s8FromCString(directory));
+	appendChar(path, '/');
+	for (int i = 60; i >= 0; i -= 4) appendChar(path, "0123456789abcdef"[(key.a >> i) & 15]);
+	for (int i = 60; i >= 0; i -= 4) appendChar(path, "0123456789abcdef"[(key.b >> i) & 15]);
+	appendChar(path, 0);
+}
+
+static bool WriteFileAll(int fd, const void* data, ptrdiff_t len)
+{
+	const unsigned char* p = data;
+	while (len > 0)
+	{
+		ssize_t ret = write(fd, p, len);
+		if (ret <= 0) return false;
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+// Written to a temporary file and renamed into place, so a reader never sees half a result
+static void ResultFileStore(char* directory, ResultKey key, s8 output, bool truncated, RuntimeError termination, long steps, LMCCoverage coverage)
+{
+	unsigned char pathMem[4096];
+	buf path = { pathMem, sizeof(pathMem), 0, false };
+	ResultFilePath(&path, directory, key);
+	unsigned char tempMem[4096];
+	buf temp = { tempMem, sizeof(tempMem), 0, false };
+	appends8(&temp, s8FromCString(directory));
+	appends8(&temp, S("/.tmpXXXXXX"));
+	appendChar(&temp, 0);
+	if (path.error || temp.error) return;
+
+	int fd = mkstemp((char*)tempMem);
+	if (fd == -1) return;
+	ResultFileHeader header;
+	memset(&header, 0, sizeof(header)); // no stray padding in the file
+	memcpy(header.magic, "LMCR", 4);
+	header.version = LMC_RESULT_VERSION;
+	header.termination = termination;
+	header.steps = steps;
+	header.truncated = truncated;
+	header.outputLength = (int)output.len;
+	header.coverage = coverage;
+	bool written = WriteFileAll(fd, &header, sizeof(header)) && WriteFileAll(fd, output.str, output.len);
+	close(fd);
+	if (!written || rename((char*)tempMem, (char*)pathMem) != 0) unlink((char*)tempMem);
+}
+
+static bool ResultFileLoad(char* directory, ResultKey key, buf* output, bool* truncated, RuntimeError* termination, long* steps, LMCCoverage* coverage)
+{
+	unsigned char pathMem[4096];
+	buf path = { pathMem, sizeof(pathMem), 0, false };
+	ResultFilePath(&path, directory, key);
+	if (path.error) return false;
+
+	s8 file = s8FileMap((char*)pathMem);
+	if (!file.str) return false;
+	ResultFileHeader header;
+	bool valid = file.len >= (ptrdiff_t)sizeof(header);
+	if (valid)
+	{
+		memcpy(&header, file.str, sizeof(header));
+		valid = memcmp(header.magic, "LMCR", 4) == 0 && header.version == LMC_RESULT_VERSION &&
+			header.outputLength >= 0 && file.len - (ptrdiff_t)sizeof(header) == header.outputLength;
+	}
+	if (valid)
+	{
+		output->len = 0;
+		output->error = false;
+		append(output, file.str + sizeof(header), header.outputLength);
+		*truncated = header.truncated;
+		*termination = header.termination;
+		*steps = header.steps;
+		*coverage = header.coverage;
+	}
+	s8FileUnmap(file);
+	return valid;
+}
+
+// Fills in the result of an earlier run of the same job, if there was one
+static bool ResultCacheFind(ResultCache* cache, ResultKey key, buf* output, RuntimeError* termination, long* steps, LMCCoverage* coverage)
+{
+	bool found = false;
+	bool truncated = false;
+	pthread_mutex_lock(&cache->lock);
+	CachedResult* slot = ResultCacheSlot(cache, key);
+	if (slot->used)
+	{
+		output->len = 0;
+		append(output, slot->output, slot->outputLength);
+		truncated = slot->truncated;
+		*termination = slot->termination;
+		*steps = slot->steps;
+		*coverage = slot->coverage;
+		found = true;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!found && cache->directory)
+	{
+		found = ResultFileLoad(cache->directory, key, output, &truncated, termination, steps, coverage);
+		if (found) ResultCacheInsert(cache, key, bufTos8(output), truncated, *termination, *steps, *coverage);
+	}
+	if (found) output->error = truncated;
+	return found;
+}
+
+static void ResultCacheStore(ResultCache* cache, ResultKey key, buf* output, RuntimeError termination, long steps, LMCCoverage coverage)
+{
+	ResultCacheInsert(cache, key, bufTos8(output), output->error, termination, steps, coverage);
+	if (cache->directory) ResultFileStore(cache->directory, key, bufTos8(output), output->error, termination, steps, coverage);
+}
@@ -0,0 +1,484 @@
+// --serve: run sessions for many clients from one process, over a Unix domain socket
+// A client connects, sends the program path and a newline, then whatever it would have piped into
+// stdin. Everything the CLI would print comes back on the same connection, then the server closes it.
+// One thread drives every session off an epoll loop. INP doesn't block - the context parks with
+// ERROR_NEED_INPUT until a whole integer has arrived - and a running session gets a quantum of
+// instructions at a time, so a busy loop can't starve the others. Programs are assembled once and kept,
+// up to SERVE_IMAGE_CAPACITY of them - the least recently used one goes to make room for another.
+// The socket is only accessible to the user running the server, since clients can name any file it can read.
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+
+// Sessions with this much unsent output aren't run again until the client catches up
+#define SESSION_OUTPUT_HIGH_WATER (1<<16)
+
+// Assembled programs kept at once, and hash chains to find them by path
+#define SERVE_IMAGE_CAPACITY 256
+#define SERVE_IMAGE_BUCKETS 512
+
+typedef struct ServeImage ServeImage;
+struct ServeImage
+{
+	char* path;
+	unsigned long long hash; // of path
+	ServeImage* nextInBucket;
+	ServeImage* newer; // least recently used order, for eviction
+	ServeImage* older;
+	LMCContext image;
+	struct timespec mtime; // assembled again if the file changes
+	int errorLine; // -1 if it assembled
+	s8 errorMessage;
+	unsigned char messageMem[128];
+};
+
+typedef enum
+{
+	SESSION_HEADER, // waiting for the program path
+	SESSION_RUNNING,
+	SESSION_INPUT, // parked on an INP until a whole integer arrives
+	SESSION_DONE, // sending what's left of the output, then closing
+} SessionState;
+
+typedef struct Session Session;
+struct Session
+{
+	int fd;
+	SessionState state;
+	LMCContext x;
+	long steps;
+	bool readable; // edge triggered, so these stay set until a read/write would block
+	bool writable;
+	bool inputEof;
+	bool dead; // connection failed, drop it without sending anything else
+	bool queued;
+	Session* nextRunnable;
+
+	unsigned char* out;
+	ptrdiff_t outCapacity;
+	ptrdiff_t outLen;
+	ptrdiff_t outPos; // [outPos, outLen) is still to be sent
+
+	ptrdiff_t inLen;
+	ptrdiff_t inPos; // [inPos, inLen) hasn't been parsed yet
+	unsigned char in[1<<12];
+};
+
+typedef struct
+{
+	int epfd;
+	int listenFd;
+	long quantum;
+	long maxSteps;
+	ServeImage* buckets[SERVE_IMAGE_BUCKETS];
+	ServeImage* newest;
+	ServeImage* oldest;
+	int imageCount;
+	Session* runHead; // sessions that can execute right now, first in first out
+	Session* runTail;
+} Server;
+
+static void OutCallbackSession(unsigned char* str, ptrdiff_t len, void* ctx)
+{
+	Session* s = ctx;
+	if (s->outCapacity - s->outLen < len)
+	{
+		// drop what's been sent before growing
+		memmove(s->out, s->out + s->outPos, s->outLen - s->outPos);
+		s->outLen -= s->outPos;
+		s->outPos = 0;
+	}
+	if (s->outCapacity - s->outLen < len)
+	{
+		ptrdiff_t capacity = s->outCapacity ? s->outCapacity : 1<<12;
+		while (capacity - s->outLen < len) capacity *= 2;
+		unsigned char* out = realloc(s->out, capacity);
+		if (!out)
+		{
+			s->dead = true;
+			return;
+		}
+		s->out = out;
+		s->outCapacity = capacity;
+	}
+	memcpy(s->out + s->outLen, str, len);
+	s->outLen += len;
+}
+
+static void ServerQueue(Server* server, Session* s)
+{
+	s->queued = true;
+	s->nextRunnable = 0;
+	if (server->runTail) server->runTail->nextRunnable = s;
+	else server->runHead = s;
+	server->runTail = s;
+}
+
+static Session* ServerDequeue(Server* server)
+{
+	Session* s = server->runHead;
+	if (!s) return 0;
+	server->runHead = s->nextRunnable;
+	if (!server->runHead) server->runTail = 0;
+	s->queued = false;
+	return s;
+}
+
+static unsigned long long PathHash(const char* path)
+{
+	// FNV-1a
+	unsigned long long hash = 0xCBF29CE484222325ull;
+	for (; *path; ++path) hash = (hash ^ (unsigned char)*path) * 0x100000001B3ull;
+	return hash;
+}
+
+static void ImageUnlinkRecent(Server* server, ServeImage* image)
+{
+	if (image->newer) image->newer->older = image->older;
+	else server->newest = image->older;
+	if (image->older) image->older->newer = image->newer;
+	else server->oldest = image->newer;
+}
+
+static void ImageLinkNewest(Server* server, ServeImage* image)
+{
+	image->newer = 0;
+	image->older = server->newest;
+	if (server->newest) server->newest->newer = image;
+	else server->oldest = image;
+	server->newest = image;
+}
+
+// Sessions copy the image when they start, so nothing else points at it
+static void ImageEvictOldest(Server* server)
+{
+	ServeImage* image = server->oldest;
+	ImageUnlinkRecent(server, image);
+	ServeImage** link = &server->buckets[image->hash % SERVE_IMAGE_BUCKETS];
+	while (*link != image) link = &(*link)->nextInBucket;
+	*link = image->nextInBucket;
+	--server->imageCount;
+	free(image->path);
+	free(image);
+}
+
+// Assembled program for path, from the cache unless the file changed since. Null if it can't be read
+static ServeImage* ServerImage(Server* server, char* path)
+{
+	struct stat stbuf;
+	if (stat(path, &stbuf) == -1) return 0;
+
+	unsigned long long hash = PathHash(path);
+	ServeImage** bucket = &server->buckets[hash % SERVE_IMAGE_BUCKETS];
+	ServeImage* image = *bucket;
+	while (image && (image->hash != hash || strcmp(image->path, path) != 0)) image = image->nextInBucket;
+	if (image)
+	{
+		ImageUnlinkRecent(server, image);
+		ImageLinkNewest(server, image);
+		if (image->mtime.tv_sec == stbuf.st_mtim.tv_sec && image->mtime.tv_nsec == stbuf.st_mtim.tv_nsec)
+			return image;
+	}
+
+	s8 source = s8FileMap(path);
+	if (!source.str) return 0;
+
+	if (!image)
+	{
+		if (server->imageCount == SERVE_IMAGE_CAPACITY) ImageEvictOldest(server);
+		image = malloc(sizeof(ServeImage));
+		char* pathCopy = strdup(path);
+		if (!image || !pathCopy)
+		{
+			free(image);
+			free(pathCopy);
+			s8FileUnmap(source);
+			return 0;
+		}
+		image->path = pathCopy;
+		image->hash = hash;
+		image->nextInBucket = *bucket;
+		*bucket = image;
+		ImageLinkNewest(server, image);
+		++server->imageCount;
+	}
+
+	image->image = (LMCContext){0};
+	image->mtime = stbuf.st_mtim;
+	Arena arena = { &image->messageMem[0], &image->messageMem[sizeof(image->messageMem)] };
+	AssemblerError error = LoadProgram(path, source, &image->image, &arena, 0);
+	image->errorLine = error.lineNumber;
+	image->errorMessage = error.message;
+	s8FileUnmap(source);
+	return image;
+}
+
+static void SessionReceive(Session* s)
+{
+	if (s->inPos > 0)
+	{
+		memmove(s->in, s->in + s->inPos, s->inLen - s->inPos);
+		s->inLen -= s->inPos;
+		s->inPos = 0;
+	}
+
+	while (s->readable && s->inLen < (ptrdiff_t)sizeof(s->in))
+	{
+		ssize_t bytesRead = recv(s->fd, s->in + s->inLen, sizeof(s->in) - s->inLen, 0);
+		if (bytesRead > 0) s->inLen += bytesRead;
+		else if (bytesRead == 0)
+		{
+			s->inputEof = true;
+			s->readable = false;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) s->readable = false;
+		else if (errno != EINTR)
+		{
+			s->dead = true;
+			s->readable = false;
+		}
+	}
+}
+
+static void SessionFlush(Session* s)
+{
+	while (s->writable && s->outPos < s->outLen)
+	{
+		ssize_t written = send(s->fd, s->out + s->outPos, s->outLen - s->outPos, MSG_NOSIGNAL);
+		if (written >= 0) s->outPos += written;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) s->writable = false;
+		else if (errno != EINTR)
+		{
+			s->dead = true;
+			s->writable = false;
+		}
+	}
+}
+
+// First line of the connection names the program
+static void SessionStart(Server* server, Session* s)
+{
+	unsigned char* newline = memchr(s->in + s->inPos, '\n', s->inLen - s->inPos);
+	if (!newline)
+	{
+		// no room left for the rest of the path, or it's never coming
+		if (s->inputEof || s->inLen == (ptrdiff_t)sizeof(s->in)) s->dead = true;
+		return;
+	}
+
+	*newline = 0;
+	if (newline > s->in + s->inPos && newline[-1] == '\r') newline[-1] = 0;
+	ServeImage* image = ServerImage(server, (char*)s->in + s->inPos);
+	s->inPos = newline + 1 - s->in;
+
+	// same as the CLI for a program that doesn't exist: nothing is printed
+	if (!image)
+	{
+		s->state = SESSION_DONE;
+		return;
+	}
+
+	if (image->errorLine != -1)
+	{
+		unsigned char mem[12];
+		buf line = { &mem[0], sizeof(mem), 0, false };
+		appendInteger(&line, image->errorLine);
+		appends8(&line, S(": "));
+		OutCallbackSession(line.buf, line.len, s);
+		OutCallbackSession(image->errorMessage.str, image->errorMessage.len, s);
+		OutCallbackSession((unsigned char*)"\n", 1, s);
+		s->state = SESSION_DONE;
+		return;
+	}
+
+	s->x = image->image;
+	s->x.inpFunction = 0; // INP parks the session instead of calling back
+	s->x.outFunction = OutCallbackSession;
+	s->x.outputCtx = s;
+	s->state = SESSION_RUNNING;
+}
+
+// Takes the next integer off the input if a whole one has arrived, returns false to wait for more
+static bool SessionTakeInteger(Session* s, ReadResult* result, int* input)
+{
+	ptrdiff_t i = s->inPos;
+	while (i < s->inLen && IsWhiteSpace(s->in[i])) ++i;
+	while (i < s->inLen && !IsWhiteSpace(s->in[i])) ++i;
+	// a token that fills the whole buffer is taken as it is, it's too long to be a valid integer anyway
+	bool full = s->inPos == 0 && s->inLen == (ptrdiff_t)sizeof(s->in);
+	if (i == s->inLen && !s->inputEof && !full) return false;
+
+	InputReader reader;
+	InputReaderInitMemory(&reader, (s8){ s->in + s->inPos, s->inLen - s->inPos });
+	*result = ReadInteger(&reader, input);
+	s->inPos += reader.pos;
+	return true;
+}
+
+static void SessionRun(Server* server, Session* s)
+{
+	long budget = server->maxSteps - s->steps;
+	if (budget > server->quantum) budget = server->quantum;
+
+	// the interpreter rather than the JIT: sessions of different programs take turns every quantum,
+	// and JitRun() would compile the image again each time
+	long ran = 0;
+	RuntimeError error = Run(&s->x, budget, &ran);
+	s->steps += ran;
+
+	if (error == ERROR_NEED_INPUT) s->state = SESSION_INPUT;
+	else if (error == ERROR_BUDGET_EXHAUSTED)
+	{
+		// like --batch, a runaway program just stops without a message
+		if (s->steps >= server->maxSteps) s->state = SESSION_DONE;
+	}
+	else
+	{
+		unsigned char mem[64];
+		Arena arena = { &mem[0], &mem[sizeof(mem)] };
+		s8 message = RuntimeError_StrErrorArena(&s->x, error, &arena);
+		OutCallbackSession(message.str, message.len, s);
+		OutCallbackSession((unsigned char*)"\n", 1, s);
+		s->state = SESSION_DONE;
+	}
+}
+
+static void SessionClose(Session* s)
+{
+	close(s->fd);
+	free(s->out);
+	free(s);
+}
+
+// Moves a session along as far as it can go without blocking, and queues it if it can run
+static void SessionPump(Server* server, Session* s)
+{
+	if (s->readable) SessionReceive(s);
+	if (s->state == SESSION_HEADER) SessionStart(server, s);
+
+	while (s->state == SESSION_INPUT)
+	{
+		ReadResult result;
+		int input;
+		if (!SessionTakeInteger(s, &result, &input)) break;
+
+		if (result == READ_OK)
+		{
+			ProvideInput(&s->x, input);
+			++s->steps;
+			s->state = SESSION_RUNNING;
+		}
+		// the CLI exits at the end of input without printing anything else
+		else if (result == READ_EOF) s->state = SESSION_DONE;
+		// bad input is skipped, and the INP waits for the next one
+	}
+
+	if (s->writable) SessionFlush(s);
+
+	if (s->queued) return; // the run loop gets back to it
+	if (s->dead || (s->state == SESSION_DONE && s->outPos == s->outLen))
+	{
+		SessionClose(s);
+		return;
+	}
+	if (s->state == SESSION_RUNNING && s->outLen - s->outPos < SESSION_OUTPUT_HIGH_WATER)
+		ServerQueue(server, s);
+}
+
+static void ServerAccept(Server* server)
+{
+	while (true)
+	{
+		int fd = accept(server->listenFd, 0, 0);
+		if (fd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			return; // EAGAIN once the backlog is empty, anything else is retried on the next event
+		}
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		Session* s = malloc(sizeof(Session));
+		if (!s)
+		{
+			close(fd);
+			continue;
+		}
+		memset(s, 0, offsetof(Session, in));
+		s->fd = fd;
+		s->state = SESSION_HEADER;
+
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.ptr = s;
+		if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &event) == -1) SessionClose(s);
+	}
+}
+
+static int RunServer(char* socketPath, long quantum, long maxSteps)
+{
+	struct sockaddr_un address = {0};
+	address.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(address.sun_path)) return 1;
+	strcpy(address.sun_path, socketPath);
+
+	// a socket left behind by an earlier server would make bind fail, anything else is left alone
+	struct stat stbuf;
+	if (stat(socketPath, &stbuf) == 0 && S_ISSOCK(stbuf.st_mode)) unlink(socketPath);
+
+	Server server = {0};
+	server.quantum = quantum;
+	server.maxSteps = maxSteps;
+	server.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server.listenFd == -1) return 1;
+	// created owner only, there's no window where someone else could connect
+	mode_t mask = umask(0177);
+	int bound = bind(server.listenFd, (struct sockaddr*)&address, sizeof(address));
+	umask(mask);
+	if (bound == -1) return 1;
+	if (listen(server.listenFd, SOMAXCONN) == -1) return 1;
+
+	server.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (server.epfd == -1) return 1;
+	struct epoll_event listenEvent;
+	listenEvent.events = EPOLLIN;
+	listenEvent.data.ptr = 0; // sessions are never null
+	if (epoll_ctl(server.epfd, EPOLL_CTL_ADD, server.listenFd, &listenEvent) == -1) return 1;
+
+	struct epoll_event events[64];
+	while (true)
+	{
+		// don't sleep while there's work to do, just pick up whatever I/O is ready
+		int count = epoll_wait(server.epfd, events, 64, server.runHead ? 0 : -1);
+		if (count == -1 && errno != EINTR) return 1;
+
+		for (int i = 0; i < count; ++i)
+		{
+			Session* s = events[i].data.ptr;
+			if (!s)
+			{
+				ServerAccept(&server);
+				continue;
+			}
+			// errors and hangups show up as failed reads/writes
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) s->readable = true;
+			if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) s->writable = true;
+			SessionPump(&server, s);
+		}
+
+		// one quantum for each session that was runnable at the start of this round
+		Session* last = server.runTail;
+		while (last)
+		{
+			Session* s = ServerDequeue(&server);
+			bool lastOfRound = s == last;
+			if (s->state == SESSION_RUNNING && !s->dead) SessionRun(&server, s);
+			SessionPump(&server, s); // can free s
+			if (lastOfRound) break;
+		}
+	}
+}
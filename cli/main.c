@@ -1,4 +1,5 @@
 #include "lmc.h"
+#include <stdint.h>
 
 #define S(s) (s8) { (unsigned char*)s, (ptrdiff_t)(sizeof(s)-1) }
 
@@ -36,6 +37,25 @@ static void appends8(buf* buffer, s8 string)
 	append(buffer, string.str, string.len);
 }
 
+static void appendLong(buf* buffer, long x)
+{
+	unsigned char tmp[64];
+	unsigned char* end = &tmp[sizeof(tmp)];
+	unsigned char* beginning = end;
+	long t = x>0 ? -x : x;
+	do
+	{
+		--beginning;
+		*beginning = '0' - t%10;
+	} while (t /= 10);
+	if  (x < 0)
+	{
+		--beginning;
+		*beginning = '-';
+	}
+	append(buffer, beginning, end-beginning);
+}
+
 static void appendInteger(buf* buffer, int x)
 {
 	unsigned char tmp[64];
@@ -61,15 +81,58 @@ static void appendChar(buf* buffer, unsigned char c)
 	append(buffer, &c, 1);
 }
 
+static bool s8Equal(s8 a, s8 b)
+{
+	if (a.len != b.len) return false;
+
+	for (int i = 0; i < a.len; ++i)
+	{
+		if (a.str[i] != b.str[i])
+			return false;
+	}
+
+	return true;
+}
+
+static s8 s8FromCString(char* s)
+{
+	s8 ret = (s8) { (unsigned char*)s, 0 };
+	while (s[ret.len]) ++ret.len;
+	return ret;
+}
+
+// Parses a positive decimal size argument
+static bool ParseSize(char* s, ptrdiff_t* result)
+{
+	ptrdiff_t value = 0;
+	if (!*s) return false;
+	for (; *s; ++s)
+	{
+		if (*s < '0' || *s > '9') return false;
+		if (value > (PTRDIFF_MAX - 9) / 10) return false;
+		value = value*10 + (*s - '0');
+	}
+	if (value == 0) return false;
+	*result = value;
+	return true;
+}
+
 
 ///////////////////////////////////////////////////////
 
 
+#include "object.c"
+#include "tracefile.c"
+#include "profilereport.c"
+
 #ifdef __linux__
 
+#include "linux/outcallback.c"
 #include "linux/inpcallback.c"
 #include "linux/mapfile.c"
-#include "linux/outcallback.c"
+#include "linux/resultcache.c"
+#include "linux/batch.c"
+#include "linux/serve.c"
 
 #elifdef __WIN32__
 
@@ -81,10 +144,105 @@ static void appendChar(buf* buffer, unsigned char c)
 
 #endif
 
+#include "emitc.c"
+
 int main(int argc, char* argv[])
 {
-	if (argc <= 1) return 0;
-	s8 program = s8FileMap(argv[1]);
+	bool emitC = false;
+	bool detectLoops = false;
+	bool optimize = false;
+	bool assembleOnly = false;
+	bool profiling = false;
+	bool coverage = false;
+	char* objectName = 0;
+	char* traceName = 0;
+	char* fileName = 0;
+	char* manifestName = 0;
+	char* socketPath = 0;
+	char* cacheDirectory = 0;
+	// sizes are never 0 once parsed, so 0 means not given
+	ptrdiff_t quantum = 0;
+	ptrdiff_t outBufferSize = 0;
+	ptrdiff_t workerCount = 0;
+	ptrdiff_t maxSteps = 100000000;
+	bool stepLimit = false; // a plain run has no limit unless one is asked for
+	for (int i = 1; i < argc; ++i)
+	{
+		s8 arg = s8FromCString(argv[i]);
+		if (s8Equal(arg, S("--emit-c"))) emitC = true;
+		else if (s8Equal(arg, S("--detect-loops"))) detectLoops = true;
+		else if (s8Equal(arg, S("--optimize"))) optimize = true;
+		else if (s8Equal(arg, S("--assemble-only"))) assembleOnly = true;
+		else if (s8Equal(arg, S("--profile"))) profiling = true;
+		else if (s8Equal(arg, S("--coverage"))) coverage = true;
+		else if (s8Equal(arg, S("--trace")))
+		{
+			if (i+1 >= argc) return 1;
+			traceName = argv[++i];
+		}
+		else if (s8Equal(arg, S("-o")))
+		{
+			if (i+1 >= argc) return 1;
+			objectName = argv[++i];
+		}
+		else if (s8Equal(arg, S("--out-buffer")))
+		{
+			if (i+1 >= argc || !ParseSize(argv[++i], &outBufferSize)) return 1;
+		}
+		else if (s8Equal(arg, S("--batch")))
+		{
+			if (i+1 >= argc) return 1;
+			manifestName = argv[++i];
+		}
+		else if (s8Equal(arg, S("--cache")))
+		{
+			if (i+1 >= argc) return 1;
+			cacheDirectory = argv[++i];
+		}
+		else if (s8Equal(arg, S("--jobs")))
+		{
+			if (i+1 >= argc || !ParseSize(argv[++i], &workerCount)) return 1;
+		}
+		else if (s8Equal(arg, S("--serve")))
+		{
+			if (i+1 >= argc) return 1;
+			socketPath = argv[++i];
+		}
+		else if (s8Equal(arg, S("--quantum")))
+		{
+			if (i+1 >= argc || !ParseSize(argv[++i], &quantum)) return 1;
+		}
+		else if (s8Equal(arg, S("--max-steps")))
+		{
+			if (i+1 >= argc || !ParseSize(argv[++i], &maxSteps)) return 1;
+			stepLimit = true;
+		}
+		else fileName = argv[i];
+	}
+
+	// every flag has to do something in the mode it's given in, none of them are silently ignored
+	if ((socketPath != 0) + (manifestName != 0) + assembleOnly + emitC > 1) return 1;
+	bool running = !socketPath && !manifestName && !assembleOnly && !emitC; // a plain run of fileName
+	if ((traceName != 0) + profiling + detectLoops > 1) return 1; // one engine at a time
+	if ((traceName || profiling || outBufferSize) && !running) return 1;
+	if (detectLoops && !running && !manifestName) return 1;
+	if (stepLimit && (assembleOnly || emitC)) return 1;
+	if (optimize && !running && !emitC) return 1;
+	if (objectName && !assembleOnly) return 1;
+	if ((cacheDirectory || workerCount || coverage) && !manifestName) return 1;
+	if (coverage && detectLoops) return 1;
+	if (quantum && !socketPath) return 1;
+	if (fileName && (socketPath || manifestName)) return 1;
+
+	if (!quantum) quantum = 10000;
+	if (!outBufferSize) outBufferSize = 1<<16;
+	if (!workerCount) workerCount = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (socketPath) return RunServer(socketPath, quantum, maxSteps);
+	if (manifestName) return RunBatch(manifestName, workerCount > INT_MAX ? INT_MAX : workerCount, maxSteps, detectLoops, coverage, cacheDirectory);
+
+	if (!fileName) return 0;
+	s8 program = s8FileMap(fileName);
 
 	// for a nonexistent file, gcc returns 1
 	// so, I assume it's the correct thing to do here
@@ -95,7 +253,10 @@ int main(int argc, char* argv[])
 	x.inpFunction = InpCallbackDefault;
 	x.outFunction = OutCallbackDefault;
 
-	AssemblerError ret = Assemble(program, &x, true);
+	static unsigned char messageMem[1<<14];
+	Arena messages = { &messageMem[0], &messageMem[sizeof(messageMem)] };
+	int lines[100];
+	AssemblerError ret = LoadProgram(fileName, program, &x, &messages, lines);
 
 	if (ret.lineNumber != -1)
 	{
@@ -116,22 +277,73 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
+	if (assembleOnly)
+	{
+		if (!objectName) return 1;
+		return WriteObject(objectName, &x, lines) ? 0 : 1;
+	}
+
+	// programs it can't prove safe to rewrite just run as they are
+	// the optimized image is packed differently, so its mailboxes no longer match source lines
+	if (optimize && OptimizeImage(&x)) memset(lines, 0, sizeof(lines));
+
+	if (emitC)
+	{
+		EmitC(&x);
+		return 0;
+	}
+
+	OutputBuffer out;
+	out.buf = malloc(outBufferSize);
+	out.capacity = outBufferSize;
+	out.len = 0;
+	if (!out.buf) return 1;
+	x.outputCtx = &out;
+
+	// output is flushed whenever INP has to wait for more input, so interactive prompts still appear
+	static unsigned char inMem[1<<16];
+	InputReader reader;
+	InputReaderInit(&reader, inMem, sizeof(inMem), &out);
+	x.inputCtx = &reader;
+
+	// null if there's no JIT for this platform, JitRun() then interprets
+	LMCJit* jit = JitCreate();
+
+	// --trace keeps the last 64k instructions, 1 MiB. It runs on Step(), several times slower than JitRun()
+	LMCTrace trace = { 0, 1<<16, 0 };
+	if (traceName)
+	{
+		trace.records = malloc(trace.capacity * sizeof(LMCTraceRecord));
+		if (!trace.records) return 1;
+	}
+
+	LMCProfile profile;
+	memset(&profile, 0, sizeof(profile));
+
 	RuntimeError termination;
+	long remaining = stepLimit ? maxSteps : -1;
 	while (true)
 	{
-		termination = Step(&x);
+		long ran = 0;
+		if (traceName) termination = RunTraced(&x, &trace, remaining, &ran);
+		else if (profiling) termination = RunProfiled(&x, &profile, remaining, &ran);
+		else if (detectLoops) termination = RunDetectLoops(&x, remaining, &ran);
+		else termination = JitRun(jit, &x, remaining, &ran);
+		if (remaining > 0) remaining -= ran;
 
-		if (termination == ERROR_BAD_INPUT)
-		{
-			s8 s = RuntimeError_StrError(&x, termination);
-			OutCallbackDefault(s.str, s.len, 0);
-		}
-		else if (termination != ERROR_OK) break;
+		if (termination != ERROR_BAD_INPUT) break;
+		s8 s = RuntimeError_StrError(&x, termination);
+		OutCallbackDefault(s.str, s.len, &out);
 	}
 	s8 s = RuntimeError_StrError(&x, termination);
 
-	OutCallbackDefault(s.str, s.len, 0);
+	OutCallbackDefault(s.str, s.len, &out);
 
 	unsigned char n = '\n';
-	OutCallbackDefault(&n, 1, 0);
+	OutCallbackDefault(&n, 1, &out);
+	// halt or runtime error, either way nothing else will be written
+	OutFlush(&out);
+
+	if (profiling) PrintProfile(stderr, &profile, lines, IsObjectPath(fileName) ? (s8){ 0, 0 } : program);
+	if (traceName && !WriteTraceFile(traceName, &trace)) return 1;
 }
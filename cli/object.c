@@ -0,0 +1,72 @@
+// .lmco: an assembled program, written by --assemble-only -o and run like a .lmc file
+// Loading one is a validity check on the mapped file and a 400 byte copy, no text is parsed. The map is
+// read only, so every process running the same object shares one copy of it in the page cache.
+// Fields are in the byte order of the machine that wrote it.
+
+#include <stdio.h>
+#include <string.h>
+
+#define LMC_OBJECT_VERSION 1
+
+typedef struct
+{
+	char magic[4]; // "LMCO"
+	unsigned int version;
+	unsigned long long hash; // of mailBoxes and lines, catches truncated or damaged files
+	int mailBoxes[100];
+	int lines[100]; // source line each mailbox came from, 0 if none
+} LMCObject;
+
+static unsigned long long ObjectHash(const LMCObject* object)
+{
+	// FNV-1a
+	unsigned long long hash = 0xCBF29CE484222325ull;
+	const unsigned char* p = (const unsigned char*)object->mailBoxes;
+	ptrdiff_t len = sizeof(object->mailBoxes) + sizeof(object->lines);
+	for (ptrdiff_t i = 0; i < len; ++i) hash = (hash ^ p[i]) * 0x100000001B3ull;
+	return hash;
+}
+
+static bool IsObjectPath(const char* path)
+{
+	size_t len = strlen(path);
+	return len >= 5 && strcmp(path + len - 5, ".lmco") == 0;
+}
+
+// Null unless contents is a whole, undamaged object
+static const LMCObject* ObjectFromFile(s8 contents)
+{
+	if (contents.len != (ptrdiff_t)sizeof(LMCObject)) return 0;
+	const LMCObject* object = (const LMCObject*)contents.str; // mmap is page aligned
+	if (memcmp(object->magic, "LMCO", 4) != 0 || object->version != LMC_OBJECT_VERSION) return 0;
+	if (object->hash != ObjectHash(object)) return 0;
+	return object;
+}
+
+// Assembles contents, or loads it as an object if path ends in .lmco. lines can be null
+static AssemblerError LoadProgram(const char* path, s8 contents, LMCContext* image, Arena* arena, int* lines)
+{
+	if (!IsObjectPath(path)) return AssembleLines(contents, image, true, arena, lines);
+
+	const LMCObject* object = ObjectFromFile(contents);
+	if (!object) return (AssemblerError){ 0, S("not a valid .lmco file") };
+	memcpy(image->mailBoxes, object->mailBoxes, sizeof(image->mailBoxes));
+	if (lines) memcpy(lines, object->lines, sizeof(object->lines));
+	return (AssemblerError){ -1, {0, 0} };
+}
+
+static bool WriteObject(const char* path, const LMCContext* image, const int* lines)
+{
+	LMCObject object;
+	memset(&object, 0, sizeof(object)); // no stray padding in the file
+	memcpy(object.magic, "LMCO", 4);
+	object.version = LMC_OBJECT_VERSION;
+	memcpy(object.mailBoxes, image->mailBoxes, sizeof(object.mailBoxes));
+	memcpy(object.lines, lines, sizeof(object.lines));
+	object.hash = ObjectHash(&object);
+
+	FILE* file = fopen(path, "wb");
+	if (!file) return false;
+	bool written = fwrite(&object, sizeof(object), 1, file) == 1;
+	return fclose(file) == 0 && written;
+}
@@ -0,0 +1,59 @@
+// Report printed by --profile, one row per mailbox that ran or was written, on stderr so it stays out
+// of the program's output. Rows carry the source line and its text when there is source to show.
+
+#include <stdio.h>
+
+// The text of each mailbox's line, split the way the assembler's GetLine() does so the numbers agree
+static void SourceLines(s8 source, const int* lines, s8* text)
+{
+	int lineNumber = 0;
+	for (int i = 0; i < 100; ++i)
+	{
+		text[i] = (s8){ 0, 0 };
+		while (lines[i] > lineNumber && source.len > 0)
+		{
+			while (source.len > 0 && *source.str == '\r') ++source.str, --source.len;
+			if (source.len > 0 && *source.str == '\n') ++source.str, --source.len;
+			ptrdiff_t len = 0;
+			while (len < source.len && source.str[len] != '\n' && source.str[len] != '\r') ++len;
+			text[i] = (s8){ source.str, len };
+			source.str += len;
+			source.len -= len;
+			++lineNumber;
+		}
+		if (lines[i] != lineNumber) text[i] = (s8){ 0, 0 };
+	}
+}
+
+// source can be empty (an object file), lines can be all zeroes (an optimized image)
+static void PrintProfile(FILE* file, const LMCProfile* profile, const int* lines, s8 source)
+{
+	s8 text[100];
+	SourceLines(source, lines, text);
+	unsigned long long total = 0;
+	for (int i = 0; i < 100; ++i) total += profile->executions[i];
+
+	fprintf(file, "profile: %llu instructions\n", total);
+	fprintf(file, " line  box        runs       %%       taken   not taken      writes  source\n");
+	for (int i = 0; i < 100; ++i)
+	{
+		unsigned long long runs = profile->executions[i];
+		unsigned long long branches = profile->taken[i] + profile->notTaken[i];
+		if (!runs && !profile->writes[i]) continue;
+
+		if (lines[i]) fprintf(file, "%5d", lines[i]);
+		else fprintf(file, "    -");
+		fprintf(file, "   %02d", i);
+		if (runs) fprintf(file, " %11llu %6.2f%%", runs, 100.0 * runs / total);
+		else fprintf(file, " %11s %7s", "", "");
+		if (branches) fprintf(file, " %11llu %11llu", profile->taken[i], profile->notTaken[i]);
+		else fprintf(file, " %11s %11s", "", "");
+		if (profile->writes[i]) fprintf(file, " %11llu", profile->writes[i]);
+		else fprintf(file, " %11s", "");
+
+		s8 line = text[i];
+		while (line.len > 0 && (*line.str == ' ' || *line.str == '\t')) ++line.str, --line.len;
+		if (line.len) fprintf(file, "  %.*s", (int)line.len, (char*)line.str);
+		fprintf(file, "\n");
+	}
+}
@@ -0,0 +1,62 @@
+// lmctrace: decode a trace file written by lmcsim --trace FILE
+// One line per instruction, numbered from the start of the run:
+//   step  pc: instruction  MNEMONIC operand  acc=value  [mailbox: old -> new]
+// Build: cc -I lib/include cli/tracedump.c -o lmctrace
+
+#include "lmc.h"
+#include "traceformat.c"
+
+static const char* Mnemonic(int instruction)
+{
+	static const char* names[10] = { "HLT", "ADD", "SUB", "STA", "???", "LDA", "BRA", "BRZ", "BRP", "???" };
+	if (instruction == 901) return "INP";
+	if (instruction == 902) return "OUT";
+	if (instruction == 922) return "OTC";
+	if (instruction < 0 || instruction > 899) return "???";
+	if (instruction > 0 && instruction < 100) return "???";
+	return names[instruction / 100];
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s trace-file\n", argv[0]);
+		return 1;
+	}
+	FILE* file = fopen(argv[1], "rb");
+	if (!file) return 1;
+
+	LMCTraceFileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "LMCT", 4) != 0 ||
+		header.version != LMC_TRACE_VERSION || header.recordSize != sizeof(LMCTraceRecord))
+	{
+		fprintf(stderr, "%s: not a trace file this decoder understands\n", argv[1]);
+		fclose(file);
+		return 1;
+	}
+
+	if (header.count > header.stored)
+		printf("... %llu earlier instructions not kept\n", header.count - header.stored);
+	unsigned long long step = header.count - header.stored;
+	LMCTraceRecord record;
+	for (unsigned int i = 0; i < header.stored; ++i, ++step)
+	{
+		if (fread(&record, sizeof(record), 1, file) != 1)
+		{
+			fprintf(stderr, "%s: truncated\n", argv[1]);
+			fclose(file);
+			return 1;
+		}
+		const char* name = Mnemonic(record.instruction);
+		printf("%llu\t%2d: %03d  %s", step, record.programCounter, record.instruction, name);
+		// HLT and I/O take no address
+		if (record.instruction >= 100 && record.instruction < 900) printf(" %02d", record.instruction % 100);
+		printf("\tacc=%d", (int)record.accumulator);
+		if (record.written != LMC_TRACE_NO_WRITE)
+			printf("\t[%02d: %d -> %d]", record.written, record.overwritten, (int)record.accumulator);
+		printf("\n");
+	}
+	fclose(file);
+	return 0;
+}
@@ -0,0 +1,25 @@
+// Writes the trace files of --trace FILE, see traceformat.c
+
+#include "traceformat.c"
+
+static bool WriteTraceFile(const char* path, const LMCTrace* trace)
+{
+	unsigned long long stored = trace->count < trace->capacity ? trace->count : trace->capacity;
+	LMCTraceFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "LMCT", 4);
+	header.version = LMC_TRACE_VERSION;
+	header.recordSize = sizeof(LMCTraceRecord);
+	header.stored = (unsigned int)stored;
+	header.count = trace->count;
+
+	FILE* file = fopen(path, "wb");
+	if (!file) return false;
+	bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+	// the ring wraps, so oldest first can be two pieces
+	unsigned long long first = (trace->count - stored) & (trace->capacity - 1);
+	unsigned long long head = trace->capacity - first < stored ? trace->capacity - first : stored;
+	written = written && fwrite(trace->records + first, sizeof(LMCTraceRecord), head, file) == head;
+	written = written && fwrite(trace->records, sizeof(LMCTraceRecord), stored - head, file) == stored - head;
+	return fclose(file) == 0 && written;
+}
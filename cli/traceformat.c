@@ -0,0 +1,16 @@
+// Layout of the trace files written by --trace FILE (tracefile.c) and read back by tracedump.c
+// A header, then the records still in the ring, oldest first. Native byte order, like .lmco
+
+#include <stdio.h>
+#include <string.h>
+
+#define LMC_TRACE_VERSION 1
+
+typedef struct
+{
+	char magic[4]; // "LMCT"
+	unsigned int version;
+	unsigned int recordSize; // sizeof(LMCTraceRecord), a decoder built with another layout can tell
+	unsigned int stored; // records in the file, the last ones of the run
+	unsigned long long count; // instructions the whole run executed
+} LMCTraceFileHeader;
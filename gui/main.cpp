@@ -10,6 +10,8 @@
 
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <cmath>
 
 // TODO investigate if it is possible omit writing the function call, by providing a conversion operator for s8
 s8 stringTos8(std::string_view s)
@@ -38,6 +40,18 @@ bool IntInputBoxZeroPadded(const char* label, int* v, ImGuiInputTextFlags flags)
 
 }
 
+void DiscardOutput(unsigned char*, ptrdiff_t, void*)
+{
+}
+
+// Cell colour for a mailbox that ran count times out of the hottest one's most, log scaled so a loop
+// doesn't wash out everything that only ran a few times
+ImU32 HeatColor(unsigned long long count, unsigned long long most)
+{
+	float heat = most > 1 ? logf(1.0f + count) / logf(1.0f + most) : 1.0f;
+	return ImGui::GetColorU32(ImVec4(0.9f, 0.35f * (1.0f - heat), 0.1f, 0.15f + 0.6f * heat));
+}
+
 void InitProgram(void)
 {
 	SetConfigFlags(FLAG_MSAA_4X_HINT | FLAG_VSYNC_HINT | FLAG_WINDOW_RESIZABLE);
@@ -65,6 +79,16 @@ int main(void)
 
 	LMCContext x = {};
 
+	// undo log for Step back, 64k steps with a checkpoint every 1024
+	static LMCUndoRecord undo[1<<16];
+	static LMCCheckpoint checkpoints[64];
+	LMCHistory history;
+	HistoryInit(&history, undo, 1<<16, checkpoints, 64, 1024);
+
+	// counts from the last Profile run, drawn over the mailbox table
+	LMCProfile profile = {};
+	bool heatmap = false;
+
 	while (!WindowShouldClose())
 	{
 		BeginDrawing();
@@ -93,6 +117,10 @@ int main(void)
 			if (ImGui::Button("Assemble into RAM"))
 			{
 				Assemble(stringTos8(code), &x, true);
+				x.accumulator = 0;
+				x.programCounter = 0;
+				HistoryInit(&history, undo, 1<<16, checkpoints, 64, 1024);
+				heatmap = false;
 				puts("");
 				for (int i = 0; i < 10; ++i)
 				{
@@ -121,6 +149,52 @@ int main(void)
 			{
 			}
 
+			ImGui::SameLine();
+			if (ImGui::Button("Step"))
+			{
+				StepRecorded(&x, &history);
+			}
+
+			// greyed out by hand, BeginDisabled() is newer than the tables and viewports used here
+			ImGui::SameLine();
+			bool canStepBack = history.step > history.oldest;
+			if (!canStepBack) ImGui::PushStyleVar(ImGuiStyleVar_Alpha, ImGui::GetStyle().Alpha * 0.5f);
+			if (ImGui::Button("Step back") && canStepBack)
+			{
+				StepBack(&x, &history, 1);
+			}
+			if (!canStepBack) ImGui::PopStyleVar();
+
+			// runs a copy, so the machine shown is left alone. Without input it stops at the first INP
+			ImGui::SameLine();
+			if (ImGui::Button("Profile"))
+			{
+				LMCContext copy = x;
+				copy.inpFunction = nullptr;
+				copy.outFunction = DiscardOutput;
+				profile = {};
+				RunProfiled(&copy, &profile, 1000000, nullptr);
+				heatmap = true;
+			}
+
+			ImGui::SameLine();
+			ImGui::Checkbox("Heatmap", &heatmap);
+
+			ImGui::SameLine();
+			ImGui::Text("Step %ld  PC %02d  ACC %d", history.step, x.programCounter, (int)x.accumulator);
+
+			// any step that's still in the log, restored from the nearest checkpoint instead of re-running
+			long long seekTo = history.step;
+			long long seekMin = history.oldest;
+			long long seekMax = history.step;
+			if (seekMax > seekMin && ImGui::SliderScalar("Go back to step", ImGuiDataType_S64, &seekTo, &seekMin, &seekMax))
+			{
+				SeekHistory(&x, &history, (long)seekTo);
+			}
+
+			unsigned long long most = 0;
+			for (int i = 0; i < 100; ++i) most = std::max(most, profile.executions[i]);
+
 			if (ImGui::BeginTable("opcodetable", 10, ImGuiTableFlags_Borders))
 			{
 				for (int i = 0; i < 10; ++i)
@@ -130,10 +204,26 @@ int main(void)
 					{
 						ImGui::TableSetColumnIndex(j);
 
+						int box = i*10+j;
+						if (heatmap && profile.executions[box])
+							ImGui::TableSetBgColor(ImGuiTableBgTarget_CellBg, HeatColor(profile.executions[box], most));
+
 						const char* label = TextFormat("%d", i*10+j);
 						ImGui::TextUnformatted(label);
+						if (heatmap && (profile.executions[box] || profile.writes[box]) && ImGui::IsItemHovered())
+						{
+							if (profile.taken[box] || profile.notTaken[box])
+								ImGui::SetTooltip("ran %llu times, branched %llu, fell through %llu",
+									profile.executions[box], profile.taken[box], profile.notTaken[box]);
+							else if (profile.executions[box])
+								ImGui::SetTooltip("ran %llu times", profile.executions[box]);
+							else
+								ImGui::SetTooltip("written %llu times", profile.writes[box]);
+						}
 						const char* idName = TextFormat("###Item %d", i*10+j);
-						IntInputBoxZeroPadded(idName, &x.mailBoxes[i*10+j], ImGuiInputTextFlags_CharsDecimal);
+						// an edit by hand isn't a step, so the log no longer describes how the state was reached
+						if (IntInputBoxZeroPadded(idName, &x.mailBoxes[i*10+j], ImGuiInputTextFlags_CharsDecimal))
+							HistoryInit(&history, undo, 1<<16, checkpoints, 64, 1024);
 					}
 				}
 				ImGui::EndTable();
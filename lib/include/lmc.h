@@ -23,6 +23,14 @@ typedef struct
 	ptrdiff_t len;
 } s8;
 
+// Caller owned memory for the library to allocate messages from, [beg, end)
+// beg moves forward past every allocation, so one arena can collect many messages
+typedef struct
+{
+	unsigned char* beg;
+	unsigned char* end;
+} Arena;
+
 // a bit of an API inconsistency to return a struct from one function and an enum from another - oh well
 typedef struct
 {
@@ -36,23 +44,256 @@ typedef enum
 	ERROR_BAD_PC, // PC value isn't valid - reached out of range
 	ERROR_HALT, // Halt instruction reached - program execution finished
 	ERROR_BAD_INSTRUCTION, // Bad instruction executed (example: 4xx)
-	ERROR_BAD_INPUT // Bad integer input given - either not an integer, or overflowed
+	ERROR_BAD_INPUT, // Bad integer input given - either not an integer, or overflowed
+	ERROR_VALUE_OVERFLOW, // STA of a value that doesn't fit a 16 bit mailbox - RunCompact() only
+	ERROR_NEED_INPUT, // INP reached with no input callback - PC is left on the INP, resume with ProvideInput()
+	ERROR_BUDGET_EXHAUSTED, // Run() and friends executed all maxSteps instructions without stopping
+	ERROR_INFINITE_LOOP // RunDetectLoops() only - the machine state repeated with no input in between
 } RuntimeError;
 // errors that can happen during runtime: example PC value is outside of [0, 99]
 
+// Native code compiled from the mailboxes, only available on x86-64 Linux
+typedef struct LMCJit LMCJit;
+
+// Number of inputs RunLanes() runs one program on at once - one AVX2 vector of ints
+#define LMC_LANES 8
+
+// LMCContext for LMC_LANES copies of one program, stored as a structure of arrays
+typedef struct
+{
+	int mailBoxes[100][LMC_LANES]; // mailbox major, so one mailbox of every lane is contiguous
+	unsigned int accumulator[LMC_LANES];
+	int programCounter[LMC_LANES];
+	long executed[LMC_LANES]; // instructions each lane completed in the last RunLanes()
+	RuntimeError status[LMC_LANES]; // why each lane stopped, ERROR_BUDGET_EXHAUSTED if it ran out of steps
+	void* inputCtx[LMC_LANES];
+	void* outputCtx[LMC_LANES];
+	InpCallback inpFunction; // shared by every lane, called with that lane's ctx
+	OutCallback outFunction;
+	int laneCount; // lanes in use, [0, LMC_LANES]
+} LMCLanes;
+
+// LMCContext for a parked session, about half the size: 16 bit mailboxes and no callbacks
+typedef struct
+{
+	short mailBoxes[100];
+	unsigned int accumulator;
+	unsigned char programCounter; // [0, 100], 100 once the program ran off the end
+} LMCCompactContext;
+
+// The callbacks and their contexts, shared by every compact context run through it
+typedef struct
+{
+	InpCallback inpFunction;
+	OutCallback outFunction;
+	void* inputCtx;
+	void* outputCtx;
+} LMCRunner;
+
+// Fixed size pool of compact contexts in caller owned memory
+typedef struct
+{
+	LMCCompactContext* contexts;
+	int capacity;
+	int used;
+	int freeHead; // index of the first free context, -1 if the pool is full
+} LMCCompactPool;
+
+// One instruction executed by RunTraced()
+typedef struct
+{
+	unsigned char programCounter; // where the instruction was
+	unsigned char written; // mailbox an STA wrote, LMC_TRACE_NO_WRITE for every other instruction
+	unsigned short reserved;
+	int instruction;
+	unsigned int accumulator; // after the instruction, so for STA also the value written
+	int overwritten; // what the written mailbox held before
+} LMCTraceRecord;
+
+#define LMC_TRACE_NO_WRITE 0xFF
+
+// Ring buffer of the latest records, in caller owned memory. Only the thread running the context writes it,
+// so there are no locks: instruction n of the trace (from 0) is records[n & (capacity-1)], and the last
+// capacity of them are still there
+typedef struct
+{
+	LMCTraceRecord* records;
+	unsigned long capacity; // power of two
+	unsigned long long count; // records ever written, keeps counting past capacity
+} LMCTrace;
+
+// What one step changed, enough to take it back
+typedef struct
+{
+	unsigned int accumulator; // before the step
+	int overwritten; // what the written mailbox held before
+	unsigned char programCounter; // before the step
+	unsigned char written; // mailbox an STA wrote, LMC_TRACE_NO_WRITE if none
+} LMCUndoRecord;
+
+// Full copy of the machine, see LMCHistory
+typedef struct
+{
+	int mailBoxes[100];
+	unsigned int accumulator;
+	int programCounter;
+	long step; // which step this is the state before, -1 if unused
+} LMCCheckpoint;
+
+// Undo log for stepping backwards, in caller owned memory. Both arrays are rings: the last
+// undoCapacity steps can be taken back, and checkpointCount checkpoints are kept, one every
+// checkpointInterval steps, so SeekHistory() never has to undo more than an interval's worth.
+// Running forward again after going back replaces the steps that were undone
+typedef struct
+{
+	LMCUndoRecord* undo;
+	long undoCapacity;
+	LMCCheckpoint* checkpoints;
+	int checkpointCount;
+	long checkpointInterval;
+	long step; // steps since the history started, where the context is now
+	long oldest; // earliest step that can still be gone back to
+} LMCHistory;
+
+// Counts kept by RunProfiled(), indexed by mailbox
+typedef struct
+{
+	unsigned long long executions[100]; // instructions that completed there
+	unsigned long long taken[100]; // BRZ/BRP there that branched
+	unsigned long long notTaken[100]; // BRZ/BRP there that fell through
+	unsigned long long writes[100]; // STAs into that mailbox
+} LMCProfile;
+
+// Mailboxes reached by RunCovered(): bit i%64 of bits[i/64] for mailbox i
+typedef struct
+{
+	unsigned long long bits[2];
+} LMCCoverage;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 // Assemble string assembly into LMCContext code
+// The error message lives in thread local memory, and is overwritten by the next call on the same thread
 AssemblerError Assemble(s8 assembly, LMCContext* code, bool strict);
 
+// Same as Assemble(), but the error message is allocated from arena. A full arena truncates the message
+AssemblerError AssembleArena(s8 assembly, LMCContext* code, bool strict, Arena* arena);
+
+// Same as AssembleArena(), and lines[i] is set to the source line mailbox i came from (0 if none).
+// lines has to have room for 100 entries, or be null
+AssemblerError AssembleLines(s8 assembly, LMCContext* code, bool strict, Arena* arena, int* lines);
+
 // Execute next instruction of code
+// With a null inpFunction, INP doesn't block: it returns ERROR_NEED_INPUT and leaves the PC where it is
 RuntimeError Step(LMCContext* code);
 
+// Finish the INP a context stopped on with ERROR_NEED_INPUT: input goes into the accumulator and the PC
+// moves past it. Returns ERROR_BAD_INSTRUCTION (and changes nothing) if the PC isn't on an INP
+RuntimeError ProvideInput(LMCContext* code, int input);
+
+// Execute up to maxSteps instructions (negative for no limit), much faster than calling Step() in a loop.
+// Stops on the same conditions Step() reports, returns ERROR_BUDGET_EXHAUSTED if maxSteps ran out first.
+// The budget is only checked once per straight-line block of instructions, so a limit costs next to nothing.
+// Simple counted loops (no I/O, counters that change by a fixed amount each time round) are skipped over in
+// closed form, with the same final state and instruction count as running them.
+// The number of instructions that completed is written to *executed, if not null
+RuntimeError Run(LMCContext* code, long maxSteps, long* executed);
+
+// Same as Run(), but stops with ERROR_INFINITE_LOOP once the whole machine state repeats without an INP
+// in between, which means it would never stop. Detection takes a small multiple of the loop's length.
+// Much slower per instruction than Run(), it's meant for running untrusted programs to a verdict
+RuntimeError RunDetectLoops(LMCContext* code, long maxSteps, long* executed);
+
+// Rewrite code into an image with the same I/O that takes fewer steps: redundant loads and stores, dead
+// stores and branches with a known outcome are removed, branch chains are threaded, and what's left is
+// packed together. Only the I/O is the same - mailbox contents and PC values are not.
+// Returns false and leaves code alone if that can't be done safely: code that an STA can reach or that is
+// read as data, or a program that can run into a bad instruction or past mailbox 99
+bool OptimizeImage(LMCContext* code);
+
+// Same contract as Run(), and every instruction that completes is appended to trace.
+// It runs the Step() interpreter, not Run()'s threaded dispatch, loop skipping or the JIT - those don't
+// trace at all - so it's about 4x slower than Run() and 8x slower than JitRun()
+RuntimeError RunTraced(LMCContext* code, LMCTrace* trace, long maxSteps, long* executed);
+
+// Same contract as Run(), and every instruction that completes is counted in profile. Counts are added
+// to whatever profile already holds, so zero it first. Costs about what RunDetectLoops() does per instruction
+RuntimeError RunProfiled(LMCContext* code, LMCProfile* profile, long maxSteps, long* executed);
+
+// Same contract as Run(), and every mailbox the PC reaches is marked in coverage - the ones that ran,
+// plus the HLT, bad instruction or INP a run stops on. Bits are only ever set, so one coverage can collect
+// many runs. About twice the cost of Run() for straight-line code, more for loops Run() would skip over
+RuntimeError RunCovered(LMCContext* code, LMCCoverage* coverage, long maxSteps, long* executed);
+
+// Start recording into history from code's current state, which becomes step 0.
+// checkpoints can be null (with checkpointCount 0) to keep no checkpoints
+void HistoryInit(LMCHistory* history, LMCUndoRecord* undo, long undoCapacity,
+	LMCCheckpoint* checkpoints, int checkpointCount, long checkpointInterval);
+
+// Same as Step() and Run(), recording every instruction that completes in history
+RuntimeError StepRecorded(LMCContext* code, LMCHistory* history);
+RuntimeError RunRecorded(LMCContext* code, LMCHistory* history, long maxSteps, long* executed);
+
+// Go back up to steps instructions, returns how many it went back (fewer once the log runs out)
+long StepBack(LMCContext* code, LMCHistory* history, long steps);
+
+// Go back to the state before instruction number step, restoring the nearest checkpoint after it first
+// when that's closer than going back one instruction at a time. Returns false (and does nothing) if
+// step is in the future or was dropped from the log
+bool SeekHistory(LMCContext* code, LMCHistory* history, long step);
+
+// Fill lanes [0, count) with copies of code, then set inputCtx/outputCtx per lane
+void LanesLoad(LMCLanes* lanes, const LMCContext* code, int count);
+
+// Copy one lane back out into a normal context
+void LanesGet(const LMCLanes* lanes, int lane, LMCContext* code);
+
+// Run every lane in lockstep until each one stops, or has run maxSteps instructions (negative for no limit).
+// Lanes that take different branches are masked out and run separately until they reach the same PC again.
+// Unlike Step(), bad input stops a lane with ERROR_BAD_INPUT in its status
+void RunLanes(LMCLanes* lanes, long maxSteps);
+
+// Store code in compact form - returns false and leaves compact alone if a mailbox doesn't fit in
+// 16 bits or the PC is outside [0, 100]
+bool CompactContext(LMCCompactContext* compact, const LMCContext* code);
+
+// Inverse of CompactContext(), callbacks come from runner (null leaves them null)
+void ExpandContext(LMCContext* code, const LMCCompactContext* compact, const LMCRunner* runner);
+
+// Same contract as Run(), executed directly on the compact form with runner's callbacks.
+// An STA of a value outside 16 bits returns ERROR_VALUE_OVERFLOW with the PC left on the STA
+RuntimeError RunCompact(const LMCRunner* runner, LMCCompactContext* compact, long maxSteps, long* executed);
+
+// ProvideInput() for a compact context
+RuntimeError ProvideInputCompact(LMCCompactContext* compact, int input);
+
+// Use capacity contexts starting at memory for the pool
+void CompactPoolInit(LMCCompactPool* pool, LMCCompactContext* memory, int capacity);
+
+// Returns a zeroed context, or null if the pool is full
+LMCCompactContext* CompactPoolAlloc(LMCCompactPool* pool);
+
+void CompactPoolFree(LMCCompactPool* pool, LMCCompactContext* compact);
+
+// Create a JIT compiler - returns null if the JIT isn't available on this platform
+LMCJit* JitCreate(void);
+
+void JitDestroy(LMCJit* jit);
+
+// Same contract as Run(), but executes native code compiled from the mailboxes.
+// Code is compiled again if the mailboxes changed since the last call, mailboxes changed by STA while
+// running are detected before they execute. A null jit (or no executable memory) just calls Run()
+RuntimeError JitRun(LMCJit* jit, LMCContext* code, long maxSteps, long* executed);
+
 // Get error string from runtime error
+// Like Assemble(), the string is in thread local memory that the next call overwrites
 s8 RuntimeError_StrError(LMCContext* code, RuntimeError error);
 
+// Same as RuntimeError_StrError(), but allocated from arena
+s8 RuntimeError_StrErrorArena(LMCContext* code, RuntimeError error, Arena* arena);
+
 #ifdef __cplusplus
 }
 #endif
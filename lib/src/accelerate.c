@@ -0,0 +1,173 @@
+// Closed form execution of counted loops, included from lmc.c
+// A loop here is mailboxes [head, tail] run straight through: only LDA/ADD/SUB/STA, one conditional
+// branch that leaves (or a conditional branch back to head as the last instruction), and a BRA head.
+// One pass over the body with symbolic values shows what an iteration does to every mailbox it stores.
+// If each one just goes up by a fixed amount, or is set to a fixed value, and the exit test looks at
+// one of those counters, the number of iterations until the exit can be solved for directly, and that
+// many iterations are applied in one go. Everything is modulo 2^32 exactly like the real arithmetic.
+
+// Value as a function of the mailboxes at the start of an iteration: mailBoxes[base] + delta,
+// or just delta for a constant
+typedef struct
+{
+	int base; // mailbox, or one of these
+	unsigned int delta;
+} LoopValue;
+
+#define LOOP_CONSTANT -1
+#define LOOP_ACCUMULATOR -2 // accumulator from before the iteration, which the analysis doesn't follow
+
+static bool LoopAdd(LoopValue* x, LoopValue y, bool subtract)
+{
+	if (x->base == LOOP_ACCUMULATOR || y.base == LOOP_ACCUMULATOR) return false;
+	// only counter +- constant stays in the form, counter + counter doesn't
+	if (y.base != LOOP_CONSTANT && (subtract || x->base != LOOP_CONSTANT)) return false;
+	if (y.base != LOOP_CONSTANT) x->base = y.base;
+	x->delta = subtract ? x->delta - y.delta : x->delta + y.delta;
+	return true;
+}
+
+// Smallest k >= 0 where start + k*step stops the loop, or -1 if it never does
+static long long LoopExitIteration(unsigned int start, unsigned int step, unsigned char op, bool exitWhenTaken)
+{
+	bool zero = op == OP_BRZ;
+	// exit test on the value is either "== 0" / "!= 0" or "(int) >= 0" / "(int) < 0"
+	bool exitOnTrue = exitWhenTaken;
+	bool now = zero ? start == 0 : (int)start >= 0;
+	if (now == exitOnTrue) return 0;
+	if (step == 0) return -1;
+
+	if (zero && !exitOnTrue) return 1; // nonzero step leaves zero straight away
+
+	if (zero)
+	{
+		// step*k == -start (mod 2^32), only solvable if step's factors of two divide start
+		unsigned int target = 0u - start;
+		int shift = 0;
+		while (!(step & 1))
+		{
+			if (target & 1) return -1;
+			step >>= 1;
+			target >>= 1;
+			++shift;
+		}
+		// inverse of an odd number mod 2^32 by Newton's method, each round doubles the correct bits
+		unsigned int inverse = step;
+		for (int i = 0; i < 5; ++i) inverse *= 2 - step*inverse;
+		unsigned int mask = shift ? (1u << (32 - shift)) - 1 : 0xFFFFFFFFu;
+		return (long long)((target * inverse) & mask);
+	}
+
+	// sign flips: counting towards zero crosses it, counting away from it wraps round at 2^31
+	long long a = (int)start;
+	long long s = (int)step;
+	if (a < 0)
+		return s > 0 ? (-a + s - 1) / s : (a + 2147483648LL) / -s + 1;
+	else
+		return s < 0 ? a / -s + 1 : (2147483647LL - a) / s + 1;
+}
+
+// Runs as many whole iterations of the loop starting at head as it can without leaving it or going over
+// budget instructions, and returns how many instructions that was (0 if the loop isn't one of these).
+// Mailboxes that were written are listed in changed
+static long AccelerateLoop(int* mailBoxes, unsigned int* accumulator, int head, long budget,
+	unsigned char* changed, int* changedCount)
+{
+	*changedCount = 0;
+
+	// find the shape of the loop
+	int condition = -1;
+	int tail = -1;
+	bool stored[100] = {0};
+	for (int i = head; i < 100 && tail == -1; ++i)
+	{
+		DecodedInstruction in = Decode(mailBoxes[i]);
+		switch (in.op)
+		{
+			case OP_ADD: case OP_SUB: case OP_LDA: break;
+			case OP_STA: stored[in.operand] = true; break;
+			case OP_BRZ:
+			case OP_BRP:
+				if (in.operand == head && condition == -1) condition = tail = i;
+				else if (condition == -1 && in.operand > head) condition = i; // exit, checked below
+				else return 0;
+				break;
+			case OP_BRA:
+				if (in.operand != head || condition == -1) return 0;
+				tail = i;
+				break;
+			default:
+				return 0; // I/O, halts, bad instructions
+		}
+	}
+	if (tail == -1) return 0;
+	bool exitWhenTaken = condition != tail;
+	DecodedInstruction branch = Decode(mailBoxes[condition]);
+	if (exitWhenTaken && branch.operand <= tail) return 0;
+	// code that changes itself is left to the interpreter
+	for (int i = head; i <= tail; ++i)
+	{
+		if (stored[i]) return 0;
+	}
+
+	// one symbolic iteration
+	LoopValue values[100];
+	for (int i = 0; i < 100; ++i)
+	{
+		values[i] = stored[i] ? (LoopValue){ i, 0 } : (LoopValue){ LOOP_CONSTANT, (unsigned int)mailBoxes[i] };
+	}
+	LoopValue acc = { LOOP_ACCUMULATOR, 0 };
+	LoopValue test = acc;
+	for (int i = head; i < tail; ++i)
+	{
+		DecodedInstruction in = Decode(mailBoxes[i]);
+		if (in.op == OP_LDA) acc = values[in.operand];
+		else if (in.op == OP_ADD || in.op == OP_SUB)
+		{
+			if (!LoopAdd(&acc, values[in.operand], in.op == OP_SUB)) return 0;
+		}
+		else if (in.op == OP_STA)
+		{
+			if (acc.base == LOOP_ACCUMULATOR) return 0;
+			values[in.operand] = acc;
+		}
+		if (i == condition) test = acc;
+	}
+	if (condition == tail) test = acc;
+	if (acc.base == LOOP_ACCUMULATOR || test.base == LOOP_ACCUMULATOR) return 0;
+
+	// every stored mailbox has to count by a fixed step, or be set to a constant
+	for (int i = 0; i < 100; ++i)
+	{
+		if (stored[i] && values[i].base != i && values[i].base != LOOP_CONSTANT) return 0;
+	}
+	if (test.base != LOOP_CONSTANT && values[test.base].base != test.base) return 0;
+	if (acc.base != LOOP_CONSTANT && values[acc.base].base != acc.base) return 0;
+
+	unsigned int testStart = test.delta;
+	unsigned int testStep = 0;
+	if (test.base != LOOP_CONSTANT)
+	{
+		testStart += (unsigned int)mailBoxes[test.base];
+		testStep = values[test.base].delta;
+	}
+	long long exitIteration = LoopExitIteration(testStart, testStep, branch.op, exitWhenTaken);
+
+	long length = tail - head + 1;
+	long iterations = budget / length;
+	if (exitIteration != -1 && exitIteration < iterations) iterations = exitIteration;
+	// not worth it, let the interpreter do these
+	if (iterations < 2) return 0;
+
+	unsigned int n = (unsigned int)iterations; // everything is mod 2^32, so the iteration count can be too
+	unsigned int accStart = acc.base == LOOP_CONSTANT ? 0 : (unsigned int)mailBoxes[acc.base] + (n - 1)*values[acc.base].delta;
+	*accumulator = accStart + acc.delta;
+	for (int i = 0; i < 100; ++i)
+	{
+		if (!stored[i]) continue;
+		if (values[i].base == LOOP_CONSTANT) mailBoxes[i] = values[i].delta;
+		else mailBoxes[i] = (unsigned int)mailBoxes[i] + n*values[i].delta;
+		changed[(*changedCount)++] = (unsigned char)i;
+	}
+	return iterations * length;
+}
@@ -0,0 +1,175 @@
+// Compact contexts, included from lmc.c
+// Sessions that spend most of their time suspended are stored in half the space of an LMCContext:
+// 16 bit mailboxes, an 8 bit PC, and the callbacks kept once in an LMCRunner shared by all of them.
+
+// PC value that marks a free entry of a pool, a real one is never above 100
+#define COMPACT_FREE 0xFF
+
+static bool FitsCompactMailbox(int value)
+{
+	return value >= SHRT_MIN && value <= SHRT_MAX;
+}
+
+bool CompactContext(LMCCompactContext* compact, const LMCContext* code)
+{
+	assert(compact && code);
+	if (code->programCounter < 0 || code->programCounter > 100) return false;
+	for (int i = 0; i < 100; ++i)
+	{
+		if (!FitsCompactMailbox(code->mailBoxes[i])) return false;
+	}
+
+	for (int i = 0; i < 100; ++i) compact->mailBoxes[i] = (short)code->mailBoxes[i];
+	compact->accumulator = code->accumulator;
+	compact->programCounter = (unsigned char)code->programCounter;
+	return true;
+}
+
+void ExpandContext(LMCContext* code, const LMCCompactContext* compact, const LMCRunner* runner)
+{
+	assert(code && compact);
+	for (int i = 0; i < 100; ++i) code->mailBoxes[i] = compact->mailBoxes[i];
+	code->accumulator = compact->accumulator;
+	code->programCounter = compact->programCounter;
+	code->inputCtx = runner ? runner->inputCtx : 0;
+	code->outputCtx = runner ? runner->outputCtx : 0;
+	code->inpFunction = runner ? runner->inpFunction : 0;
+	code->outFunction = runner ? runner->outFunction : 0;
+}
+
+// Interprets straight out of the compact form, so a resumed session doesn't have to be expanded first
+RuntimeError RunCompact(const LMCRunner* runner, LMCCompactContext* compact, long maxSteps, long* executed)
+{
+	assert(runner && compact);
+	if (maxSteps < 0) maxSteps = LONG_MAX;
+
+	short* mailBoxes = compact->mailBoxes;
+	unsigned int accumulator = compact->accumulator;
+	int pc = compact->programCounter;
+	long count = 0;
+	RuntimeError ret = ERROR_BUDGET_EXHAUSTED;
+
+	for (; count < maxSteps; ++count)
+	{
+		if (pc > 99)
+		{
+			ret = ERROR_BAD_PC;
+			break;
+		}
+
+		DecodedInstruction in = Decode(mailBoxes[pc]);
+		if (in.op == OP_HLT)
+		{
+			ret = ERROR_HALT;
+			break;
+		}
+		else if (in.op == OP_ADD) accumulator += mailBoxes[in.operand];
+		else if (in.op == OP_SUB) accumulator -= mailBoxes[in.operand];
+		else if (in.op == OP_STA)
+		{
+			if (!FitsCompactMailbox((int)accumulator))
+			{
+				ret = ERROR_VALUE_OVERFLOW;
+				break;
+			}
+			mailBoxes[in.operand] = (short)accumulator;
+		}
+		else if (in.op == OP_LDA) accumulator = mailBoxes[in.operand];
+		else if (in.op == OP_BRA)
+		{
+			pc = in.operand;
+			continue;
+		}
+		else if (in.op == OP_BRZ || in.op == OP_BRP)
+		{
+			bool taken = in.op == OP_BRZ ? accumulator == 0 : (int)accumulator >= 0;
+			if (taken)
+			{
+				pc = in.operand;
+				continue;
+			}
+		}
+		else if (in.op == OP_INP)
+		{
+			if (!runner->inpFunction)
+			{
+				ret = ERROR_NEED_INPUT;
+				break;
+			}
+			int input;
+			if (!(*runner->inpFunction)(&input, runner->inputCtx))
+			{
+				ret = ERROR_BAD_INPUT;
+				break;
+			}
+			accumulator = input;
+		}
+		else if (in.op == OP_OUT) WriteInteger(runner->outFunction, runner->outputCtx, accumulator);
+		else if (in.op == OP_OTC) WriteChar(runner->outFunction, runner->outputCtx, accumulator);
+		else
+		{
+			ret = ERROR_BAD_INSTRUCTION;
+			break;
+		}
+		++pc;
+	}
+
+	compact->accumulator = accumulator;
+	compact->programCounter = (unsigned char)pc;
+	if (executed) *executed = count;
+	return ret;
+}
+
+RuntimeError ProvideInputCompact(LMCCompactContext* compact, int input)
+{
+	assert(compact);
+	if (compact->programCounter > 99) return ERROR_BAD_PC;
+	if (compact->mailBoxes[compact->programCounter] != 901) return ERROR_BAD_INSTRUCTION;
+
+	compact->accumulator = input;
+	++compact->programCounter;
+	return ERROR_OK;
+}
+
+void CompactPoolInit(LMCCompactPool* pool, LMCCompactContext* memory, int capacity)
+{
+	assert(pool && (memory || capacity == 0));
+	pool->contexts = memory;
+	pool->capacity = capacity;
+	pool->used = 0;
+	// free entries are chained through their accumulator, in address order so allocation stays contiguous
+	pool->freeHead = capacity ? 0 : -1;
+	for (int i = 0; i < capacity; ++i)
+	{
+		memory[i].programCounter = COMPACT_FREE;
+		memory[i].accumulator = (i+1 < capacity) ? (unsigned int)(i+1) : (unsigned int)-1;
+	}
+}
+
+LMCCompactContext* CompactPoolAlloc(LMCCompactPool* pool)
+{
+	assert(pool);
+	if (pool->freeHead == -1) return 0;
+
+	LMCCompactContext* compact = &pool->contexts[pool->freeHead];
+	pool->freeHead = (int)compact->accumulator;
+	++pool->used;
+
+	for (int i = 0; i < 100; ++i) compact->mailBoxes[i] = 0;
+	compact->accumulator = 0;
+	compact->programCounter = 0;
+	return compact;
+}
+
+void CompactPoolFree(LMCCompactPool* pool, LMCCompactContext* compact)
+{
+	assert(pool);
+	if (!compact) return;
+	assert(compact >= pool->contexts && compact < pool->contexts + pool->capacity);
+	assert(compact->programCounter != COMPACT_FREE);
+
+	compact->programCounter = COMPACT_FREE;
+	compact->accumulator = (unsigned int)pool->freeHead;
+	pool->freeHead = (int)(compact - pool->contexts);
+	--pool->used;
+}
@@ -0,0 +1,95 @@
+// Coverage, included from lmc.c
+// Decoded once up front like Run(), with STA decoding the mailbox it wrote again, but no blocks, fusing or
+// loop skipping - skipped iterations would have to be marked too. Marking is a byte store per instruction
+// into a local array, nothing that depends on the last one, and it's folded into bits once at the end.
+
+RuntimeError RunCovered(LMCContext* code, LMCCoverage* coverage, long maxSteps, long* executed)
+{
+	assert(code && coverage);
+	if (maxSteps < 0) maxSteps = LONG_MAX;
+
+	// one extra slot for OP_BAD_PC, reached when the PC increments past 99
+	DecodedInstruction decoded[101];
+	for (int i = 0; i < 100; ++i)
+	{
+		decoded[i] = Decode(code->mailBoxes[i]);
+	}
+	decoded[100] = (DecodedInstruction){ OP_BAD_PC, 0 };
+	unsigned char reached[101] = {0};
+
+	int* mailBoxes = code->mailBoxes;
+	unsigned int accumulator = code->accumulator;
+	int pc = code->programCounter;
+	long count = 0;
+	RuntimeError ret = ERROR_BUDGET_EXHAUSTED;
+
+	if (pc > 99 || pc < 0)
+	{
+		ret = ERROR_BAD_PC;
+		maxSteps = 0;
+	}
+	for (; count < maxSteps; ++count)
+	{
+		// marked before it runs, so the instruction a run stops on counts too
+		reached[pc] = 1;
+		DecodedInstruction in = decoded[pc];
+		switch (in.op)
+		{
+			case OP_ADD: accumulator += mailBoxes[in.operand]; ++pc; continue;
+			case OP_SUB: accumulator -= mailBoxes[in.operand]; ++pc; continue;
+			case OP_STA:
+				mailBoxes[in.operand] = accumulator;
+				decoded[in.operand] = Decode(accumulator);
+				++pc;
+				continue;
+			case OP_LDA: accumulator = mailBoxes[in.operand]; ++pc; continue;
+			case OP_BRA: pc = in.operand; continue;
+			case OP_BRZ: pc = accumulator == 0 ? in.operand : pc + 1; continue;
+			case OP_BRP: pc = (int)accumulator >= 0 ? in.operand : pc + 1; continue;
+			case OP_INP:
+			{
+				code->accumulator = accumulator;
+				code->programCounter = pc;
+				if (!code->inpFunction)
+				{
+					ret = ERROR_NEED_INPUT;
+					break;
+				}
+				int input;
+				if (!(*code->inpFunction)(&input, code->inputCtx))
+				{
+					ret = ERROR_BAD_INPUT;
+					break;
+				}
+				accumulator = input;
+				++pc;
+				continue;
+			}
+			case OP_OUT:
+				code->accumulator = accumulator;
+				code->programCounter = pc;
+				OutputInteger(code, accumulator);
+				++pc;
+				continue;
+			case OP_OTC:
+				code->accumulator = accumulator;
+				code->programCounter = pc;
+				OutputChar(code, accumulator);
+				++pc;
+				continue;
+			case OP_HLT: ret = ERROR_HALT; break;
+			case OP_BAD_PC: ret = ERROR_BAD_PC; break;
+			default: ret = ERROR_BAD_INSTRUCTION; break;
+		}
+		break;
+	}
+
+	for (int i = 0; i < 100; ++i)
+	{
+		coverage->bits[i / 64] |= (unsigned long long)reached[i] << (i % 64);
+	}
+	code->accumulator = accumulator;
+	code->programCounter = pc;
+	if (executed) *executed = count;
+	return ret;
+}
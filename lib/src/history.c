@@ -0,0 +1,115 @@
+// Reverse execution, included from lmc.c
+// Each step only logs what it overwrites: the accumulator, the PC, and the old value of the mailbox an
+// STA wrote (INP only changes the accumulator). Going back N steps puts those back, newest first, so
+// it costs N small records no matter how long the program has run. Checkpoints of the whole machine
+// are taken every checkpointInterval steps, to jump a long way back without undoing every step between.
+
+void HistoryInit(LMCHistory* history, LMCUndoRecord* undo, long undoCapacity,
+	LMCCheckpoint* checkpoints, int checkpointCount, long checkpointInterval)
+{
+	assert(history && undo && undoCapacity > 0);
+	assert(checkpointCount == 0 || (checkpoints && checkpointInterval > 0));
+	history->undo = undo;
+	history->undoCapacity = undoCapacity;
+	history->checkpoints = checkpoints;
+	history->checkpointCount = checkpointCount;
+	history->checkpointInterval = checkpointInterval;
+	history->step = 0;
+	history->oldest = 0;
+	for (int i = 0; i < checkpointCount; ++i) checkpoints[i].step = -1;
+}
+
+static LMCCheckpoint* CheckpointSlot(LMCHistory* history, long step)
+{
+	return &history->checkpoints[(step / history->checkpointInterval) % history->checkpointCount];
+}
+
+RuntimeError StepRecorded(LMCContext* code, LMCHistory* history)
+{
+	assert(code && history);
+	int pc = code->programCounter;
+	if (pc < 0 || pc > 99) return Step(code);
+
+	if (history->checkpointCount && history->step % history->checkpointInterval == 0)
+	{
+		LMCCheckpoint* checkpoint = CheckpointSlot(history, history->step);
+		for (int i = 0; i < 100; ++i) checkpoint->mailBoxes[i] = code->mailBoxes[i];
+		checkpoint->accumulator = code->accumulator;
+		checkpoint->programCounter = pc;
+		checkpoint->step = history->step;
+	}
+
+	LMCUndoRecord record = { code->accumulator, 0, (unsigned char)pc, LMC_TRACE_NO_WRITE };
+	int instruction = code->mailBoxes[pc];
+	if (instruction >= 300 && instruction < 400)
+	{
+		record.written = (unsigned char)(instruction - 300);
+		record.overwritten = code->mailBoxes[record.written];
+	}
+
+	RuntimeError error = Step(code);
+	if (error != ERROR_OK) return error;
+
+	history->undo[history->step % history->undoCapacity] = record;
+	++history->step;
+	if (history->step - history->oldest > history->undoCapacity) history->oldest = history->step - history->undoCapacity;
+	return ERROR_OK;
+}
+
+RuntimeError RunRecorded(LMCContext* code, LMCHistory* history, long maxSteps, long* executed)
+{
+	assert(code && history);
+	if (maxSteps < 0) maxSteps = LONG_MAX;
+
+	long steps = 0;
+	RuntimeError ret = ERROR_BUDGET_EXHAUSTED;
+	for (; steps < maxSteps; ++steps)
+	{
+		RuntimeError error = StepRecorded(code, history);
+		if (error != ERROR_OK)
+		{
+			ret = error;
+			break;
+		}
+	}
+	if (executed) *executed = steps;
+	return ret;
+}
+
+long StepBack(LMCContext* code, LMCHistory* history, long steps)
+{
+	assert(code && history);
+	long done = 0;
+	for (; done < steps && history->step > history->oldest; ++done)
+	{
+		--history->step;
+		const LMCUndoRecord* record = &history->undo[history->step % history->undoCapacity];
+		if (record->written != LMC_TRACE_NO_WRITE) code->mailBoxes[record->written] = record->overwritten;
+		code->accumulator = record->accumulator;
+		code->programCounter = record->programCounter;
+	}
+	return done;
+}
+
+bool SeekHistory(LMCContext* code, LMCHistory* history, long step)
+{
+	assert(code && history);
+	if (step > history->step || step < history->oldest) return false;
+
+	if (history->checkpointCount)
+	{
+		// first checkpoint at or after step - one that isn't there any more was overwritten by a later one
+		long interval = history->checkpointInterval;
+		long at = (step + interval - 1) / interval * interval;
+		const LMCCheckpoint* checkpoint = CheckpointSlot(history, at);
+		if (checkpoint->step == at && at < history->step)
+		{
+			for (int i = 0; i < 100; ++i) code->mailBoxes[i] = checkpoint->mailBoxes[i];
+			code->accumulator = checkpoint->accumulator;
+			code->programCounter = checkpoint->programCounter;
+			history->step = at;
+		}
+	}
+	StepBack(code, history, history->step - step);
+	return true;
+}
@@ -0,0 +1,364 @@
+// x86-64 JIT backend, included from lmc.c
+// Only built for System V targets (Linux), the calling convention and mmap are baked in
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+
+// Every mailbox gets a fixed size slot of machine code, so a branch to mailbox t
+// is just a jump to code + t*SLOT_SIZE and never needs patching later
+#define SLOT_SIZE 128
+#define SLOT_COUNT 101 // the last slot is the "fell off the end" BAD_PC exit
+
+// After this many guard failures the whole image is compiled again with the current mailbox values,
+// below it the changed instructions are just interpreted with Step()
+#define RECOMPILE_THRESHOLD 64
+
+// Exit reason that isn't a RuntimeError: the mailbox about to run no longer holds what was compiled
+#define JIT_EXIT_GUARD 100
+
+typedef int(*JitEntry)(LMCContext* code, long* remaining, unsigned char* start);
+
+struct LMCJit
+{
+	int snapshot[100]; // mailbox values the code was compiled from
+	bool compiled;
+	int guardFailures;
+	size_t mapSize;
+	size_t codeSize;
+	unsigned char* code; // start of the executable pages
+	unsigned char* slots; // slot 0, after prologue/epilogue
+	unsigned char* epilogue;
+};
+
+typedef struct
+{
+	unsigned char* buf;
+	unsigned char* at;
+} Emitter;
+
+static void Emit8(Emitter* e, unsigned char b)
+{
+	*e->at++ = b;
+}
+
+static void Emit32(Emitter* e, unsigned int x)
+{
+	for (int i = 0; i < 4; ++i) Emit8(e, (x >> (8*i)) & 0xFF);
+}
+
+static void Emit64(Emitter* e, unsigned long long x)
+{
+	for (int i = 0; i < 8; ++i) Emit8(e, (x >> (8*i)) & 0xFF);
+}
+
+static void EmitBytes(Emitter* e, const char* bytes, int len)
+{
+	for (int i = 0; i < len; ++i) Emit8(e, bytes[i]);
+}
+#define EMIT(e, s) EmitBytes(e, s, sizeof(s)-1)
+
+// Jumps to code that already exists somewhere in the buffer
+static void EmitRel32(Emitter* e, unsigned char* target)
+{
+	Emit32(e, (unsigned int)(target - (e->at + 4)));
+}
+
+// Short forward jumps inside a slot - returns the displacement byte to patch once the target is known
+static unsigned char* EmitRel8Placeholder(Emitter* e)
+{
+	unsigned char* patch = e->at;
+	Emit8(e, 0);
+	return patch;
+}
+
+static void PatchRel8(Emitter* e, unsigned char* patch)
+{
+	ptrdiff_t rel = e->at - (patch + 1);
+	assert(rel >= 0 && rel <= 127);
+	*patch = (unsigned char)rel;
+}
+
+// Register use inside generated code:
+// r15 = LMCContext*, r14d = accumulator, r13 = remaining steps, rbp = long* remaining
+// [rsp] is scratch space for the INP callback result
+#define MAILBOX_DISP(i) ((unsigned int)(offsetof(LMCContext, mailBoxes) + 4*(i)))
+#define ACC_DISP ((unsigned int)offsetof(LMCContext, accumulator))
+#define PC_DISP ((unsigned int)offsetof(LMCContext, programCounter))
+
+// mov esi, pc / mov eax, reason / jmp epilogue
+static void EmitExit(Emitter* e, LMCJit* jit, int pc, int reason)
+{
+	Emit8(e, 0xBE); Emit32(e, pc);
+	Emit8(e, 0xB8); Emit32(e, reason);
+	Emit8(e, 0xE9); EmitRel32(e, jit->epilogue);
+}
+
+// Store the accumulator and PC back into code, so callbacks see the same state as under Run()
+static void EmitSyncState(Emitter* e, int pc)
+{
+	EMIT(e, "\x45\x89\xB7"); Emit32(e, ACC_DISP); // mov [r15+acc], r14d
+	EMIT(e, "\x41\xC7\x87"); Emit32(e, PC_DISP); Emit32(e, pc); // mov dword [r15+pc], imm32
+}
+
+static void EmitSlot(Emitter* e, LMCJit* jit, int k)
+{
+	unsigned char* slot = jit->slots + k*SLOT_SIZE;
+	unsigned char* next = slot + SLOT_SIZE;
+	e->at = slot;
+
+	if (k == 100)
+	{
+		EmitExit(e, jit, 100, ERROR_BAD_PC);
+		return;
+	}
+
+	int value = jit->snapshot[k];
+	DecodedInstruction in = Decode(value);
+	unsigned char* target = jit->slots + in.operand*SLOT_SIZE;
+
+	// guard: if a STA changed this mailbox since it was compiled, leave and let the host deal with it
+	EMIT(e, "\x41\x81\xBF"); Emit32(e, MAILBOX_DISP(k)); Emit32(e, value); // cmp dword [r15+mailbox], imm32
+	EMIT(e, "\x75"); unsigned char* guardFail = EmitRel8Placeholder(e); // jne guard
+	// budget: charged up front, given back if the instruction doesn't complete
+	EMIT(e, "\x49\x83\xED\x01"); // sub r13, 1
+	EMIT(e, "\x72"); unsigned char* budgetFail = EmitRel8Placeholder(e); // jb budget
+	unsigned char* inputFail = 0;
+
+	switch (in.op)
+	{
+		case OP_ADD:
+			EMIT(e, "\x45\x03\xB7"); Emit32(e, MAILBOX_DISP(in.operand)); // add r14d, [r15+mailbox]
+			Emit8(e, 0xE9); EmitRel32(e, next);
+			break;
+		case OP_SUB:
+			EMIT(e, "\x45\x2B\xB7"); Emit32(e, MAILBOX_DISP(in.operand)); // sub r14d, [r15+mailbox]
+			Emit8(e, 0xE9); EmitRel32(e, next);
+			break;
+		case OP_STA:
+			EMIT(e, "\x45\x89\xB7"); Emit32(e, MAILBOX_DISP(in.operand)); // mov [r15+mailbox], r14d
+			Emit8(e, 0xE9); EmitRel32(e, next);
+			break;
+		case OP_LDA:
+			EMIT(e, "\x45\x8B\xB7"); Emit32(e, MAILBOX_DISP(in.operand)); // mov r14d, [r15+mailbox]
+			Emit8(e, 0xE9); EmitRel32(e, next);
+			break;
+		case OP_BRA:
+			Emit8(e, 0xE9); EmitRel32(e, target);
+			break;
+		case OP_BRZ:
+			EMIT(e, "\x45\x85\xF6"); // test r14d, r14d
+			EMIT(e, "\x0F\x84"); EmitRel32(e, target); // jz target
+			Emit8(e, 0xE9); EmitRel32(e, next);
+			break;
+		case OP_BRP:
+			EMIT(e, "\x45\x85\xF6"); // test r14d, r14d
+			EMIT(e, "\x0F\x89"); EmitRel32(e, target); // jns target
+			Emit8(e, 0xE9); EmitRel32(e, next);
+			break;
+		case OP_INP:
+			EmitSyncState(e, k);
+			EMIT(e, "\x48\x8D\x3C\x24"); // lea rdi, [rsp]
+			EMIT(e, "\x49\x8B\xB7"); Emit32(e, (unsigned int)offsetof(LMCContext, inputCtx)); // mov rsi, [r15+inputCtx]
+			EMIT(e, "\x41\xFF\x97"); Emit32(e, (unsigned int)offsetof(LMCContext, inpFunction)); // call [r15+inpFunction]
+			EMIT(e, "\x84\xC0"); // test al, al
+			EMIT(e, "\x74"); inputFail = EmitRel8Placeholder(e); // jz input
+			EMIT(e, "\x44\x8B\x34\x24"); // mov r14d, [rsp]
+			Emit8(e, 0xE9); EmitRel32(e, next);
+			break;
+		case OP_OUT:
+		case OP_OTC:
+			EmitSyncState(e, k);
+			EMIT(e, "\x4C\x89\xFF"); // mov rdi, r15
+			EMIT(e, "\x44\x89\xF6"); // mov esi, r14d
+			EMIT(e, "\x48\xB8"); Emit64(e, (uintptr_t)(in.op == OP_OUT ? OutputInteger : OutputChar)); // mov rax, imm64
+			EMIT(e, "\xFF\xD0"); // call rax
+			Emit8(e, 0xE9); EmitRel32(e, next);
+			break;
+		case OP_HLT:
+			EMIT(e, "\x49\xFF\xC5"); // inc r13
+			EmitExit(e, jit, k, ERROR_HALT);
+			break;
+		default:
+			EMIT(e, "\x49\xFF\xC5"); // inc r13
+			EmitExit(e, jit, k, ERROR_BAD_INSTRUCTION);
+			break;
+	}
+
+	// cold exits, out of the straight line path
+	PatchRel8(e, guardFail);
+	EmitExit(e, jit, k, JIT_EXIT_GUARD);
+
+	PatchRel8(e, budgetFail);
+	EMIT(e, "\x49\xFF\xC5"); // inc r13
+	EmitExit(e, jit, k, ERROR_BUDGET_EXHAUSTED);
+
+	if (inputFail)
+	{
+		PatchRel8(e, inputFail);
+		EMIT(e, "\x49\xFF\xC5"); // inc r13
+		EmitExit(e, jit, k, ERROR_BAD_INPUT);
+	}
+
+	assert(e->at - slot <= SLOT_SIZE);
+	while (e->at < next) Emit8(e, 0xCC); // int3 padding
+}
+
+static void JitCompile(LMCJit* jit, LMCContext* code)
+{
+	for (int i = 0; i < 100; ++i) jit->snapshot[i] = code->mailBoxes[i];
+
+	if (mprotect(jit->code, jit->codeSize, PROT_READ | PROT_WRITE) == -1)
+	{
+		jit->compiled = false;
+		return;
+	}
+
+	Emitter e;
+	e.buf = jit->code;
+	e.at = jit->code;
+
+	// int entry(LMCContext* code, long* remaining, unsigned char* start)
+	EMIT(&e, "\x55"); // push rbp
+	EMIT(&e, "\x41\x55"); // push r13
+	EMIT(&e, "\x41\x56"); // push r14
+	EMIT(&e, "\x41\x57"); // push r15
+	EMIT(&e, "\x48\x83\xEC\x08"); // sub rsp, 8 - keeps calls 16 byte aligned
+	EMIT(&e, "\x49\x89\xFF"); // mov r15, rdi
+	EMIT(&e, "\x48\x89\xF5"); // mov rbp, rsi
+	EMIT(&e, "\x4C\x8B\x2E"); // mov r13, [rsi]
+	EMIT(&e, "\x45\x8B\xB7"); Emit32(&e, ACC_DISP); // mov r14d, [r15+acc]
+	EMIT(&e, "\xFF\xE2"); // jmp rdx
+
+	// epilogue, entered with esi = pc, eax = exit reason
+	jit->epilogue = e.at;
+	EMIT(&e, "\x45\x89\xB7"); Emit32(&e, ACC_DISP); // mov [r15+acc], r14d
+	EMIT(&e, "\x41\x89\xB7"); Emit32(&e, PC_DISP); // mov [r15+pc], esi
+	EMIT(&e, "\x4C\x89\x6D\x00"); // mov [rbp], r13
+	EMIT(&e, "\x48\x83\xC4\x08"); // add rsp, 8
+	EMIT(&e, "\x41\x5F"); // pop r15
+	EMIT(&e, "\x41\x5E"); // pop r14
+	EMIT(&e, "\x41\x5D"); // pop r13
+	EMIT(&e, "\x5D"); // pop rbp
+	EMIT(&e, "\xC3"); // ret
+
+	assert(e.at <= jit->slots);
+	for (int k = 0; k < SLOT_COUNT; ++k)
+	{
+		EmitSlot(&e, jit, k);
+	}
+
+	jit->compiled = mprotect(jit->code, jit->codeSize, PROT_READ | PROT_EXEC) != -1;
+	jit->guardFailures = 0;
+}
+
+LMCJit* JitCreate(void)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	// first page(s) hold the LMCJit itself, read/write. The rest is code, flipped between RW and RX on compile
+	size_t header = (sizeof(LMCJit) + page-1) / page * page;
+	size_t codeSize = (64 + SLOT_SIZE*SLOT_COUNT + page-1) / page * page;
+
+	void* mem = mmap(0, header + codeSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) return 0;
+
+	LMCJit* jit = mem;
+	jit->compiled = false;
+	jit->guardFailures = 0;
+	jit->mapSize = header + codeSize;
+	jit->codeSize = codeSize;
+	jit->code = (unsigned char*)mem + header;
+	jit->slots = jit->code + 64;
+	jit->epilogue = 0;
+	return jit;
+}
+
+void JitDestroy(LMCJit* jit)
+{
+	if (jit) munmap(jit, jit->mapSize);
+}
+
+// Stands in for a null inpFunction while the JIT runs. Generated INP code always calls through the
+// pointer, failing here leaves the PC on the INP exactly like bad input does, and JitRun() reports it
+// as ERROR_NEED_INPUT instead. Cheaper than another exit path in every INP slot
+static bool JitNoInput(int* input, void* ctx)
+{
+	(void) input; (void) ctx;
+	return false;
+}
+
+RuntimeError JitRun(LMCJit* jit, LMCContext* code, long maxSteps, long* executed)
+{
+	assert(code);
+	if (!jit) return Run(code, maxSteps, executed);
+
+	bool stale = !jit->compiled;
+	for (int i = 0; i < 100 && !stale; ++i)
+	{
+		stale = jit->snapshot[i] != code->mailBoxes[i];
+	}
+	if (stale) JitCompile(jit, code);
+	// couldn't get executable memory - the interpreter still works
+	if (!jit->compiled) return Run(code, maxSteps, executed);
+	if (code->programCounter > 99 || code->programCounter < 0)
+	{
+		if (executed) *executed = 0;
+		return ERROR_BAD_PC;
+	}
+
+	if (maxSteps < 0) maxSteps = LONG_MAX;
+	long remaining = maxSteps;
+	RuntimeError ret = ERROR_BUDGET_EXHAUSTED;
+	JitEntry entry = (JitEntry)(void*)jit->code;
+	bool suspendable = !code->inpFunction;
+	if (suspendable) code->inpFunction = JitNoInput;
+
+	while (remaining > 0)
+	{
+		if (code->programCounter > 99 || code->programCounter < 0)
+		{
+			ret = ERROR_BAD_PC;
+			break;
+		}
+
+		int reason = entry(code, &remaining, jit->slots + code->programCounter*SLOT_SIZE);
+		if (reason != JIT_EXIT_GUARD)
+		{
+			ret = (RuntimeError)reason;
+			break;
+		}
+
+		// self modified code: run the changed instruction in the interpreter, and once
+		// that happens often enough, compile again so hot rewritten code becomes native too
+		if (++jit->guardFailures >= RECOMPILE_THRESHOLD)
+		{
+			JitCompile(jit, code);
+			if (!jit->compiled)
+			{
+				long rest = 0;
+				ret = Run(code, remaining, &rest);
+				remaining -= rest;
+				break;
+			}
+			continue;
+		}
+		RuntimeError stepError = Step(code);
+		if (stepError != ERROR_OK)
+		{
+			ret = stepError;
+			break;
+		}
+		--remaining;
+	}
+
+	if (suspendable)
+	{
+		code->inpFunction = 0;
+		if (ret == ERROR_BAD_INPUT) ret = ERROR_NEED_INPUT;
+	}
+
+	if (executed) *executed = maxSteps - remaining;
+	return ret;
+}
+
+#undef EMIT
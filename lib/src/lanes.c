@@ -0,0 +1,266 @@
+// Lockstep interpreter, included from lmc.c
+// One program runs on LMC_LANES inputs at once. Each step picks the lowest PC of the running lanes,
+// and every lane sitting at that PC with the same instruction executes it together, the rest are
+// masked out until the leader comes back round to them. Taking the lowest PC lets lanes that went
+// different ways through a branch meet up again at the top of the next loop iteration.
+// With AVX2 one step is a few vector instructions for all lanes, otherwise the lanes are looped over.
+
+typedef unsigned int LaneMask; // bit i set for lane i
+
+#if defined(__GNUC__) && defined(__AVX2__)
+
+static __m256i LaneMaskVector(LaneMask mask)
+{
+	const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits);
+}
+
+static __m256i LanesLoadVector(const void* v)
+{
+	return _mm256_loadu_si256((const __m256i*)v);
+}
+
+// lanes of mask where v[lane] == x
+static LaneMask LanesEqual(const void* v, int x, LaneMask mask)
+{
+	__m256i equal = _mm256_cmpeq_epi32(LanesLoadVector(v), _mm256_set1_epi32(x));
+	return mask & (LaneMask)_mm256_movemask_ps(_mm256_castsi256_ps(equal));
+}
+
+// lanes of mask where (int)v[lane] >= 0
+static LaneMask LanesNonNegative(const void* v, LaneMask mask)
+{
+	return mask & ~(LaneMask)_mm256_movemask_ps(_mm256_castsi256_ps(LanesLoadVector(v)));
+}
+
+// dst[lane] = src[lane] for lanes in mask
+static void LanesCopy(void* dst, const void* src, LaneMask mask)
+{
+	__m256i result = _mm256_blendv_epi8(LanesLoadVector(dst), LanesLoadVector(src), LaneMaskVector(mask));
+	_mm256_storeu_si256((__m256i*)dst, result);
+}
+
+// dst[lane] = x for lanes in mask
+static void LanesSet(void* dst, int x, LaneMask mask)
+{
+	__m256i result = _mm256_blendv_epi8(LanesLoadVector(dst), _mm256_set1_epi32(x), LaneMaskVector(mask));
+	_mm256_storeu_si256((__m256i*)dst, result);
+}
+
+// dst[lane] += src[lane] (or -=) for lanes in mask
+static void LanesAdd(void* dst, const void* src, bool subtract, LaneMask mask)
+{
+	__m256i a = LanesLoadVector(dst);
+	__m256i b = LanesLoadVector(src);
+	__m256i sum = subtract ? _mm256_sub_epi32(a, b) : _mm256_add_epi32(a, b);
+	_mm256_storeu_si256((__m256i*)dst, _mm256_blendv_epi8(a, sum, LaneMaskVector(mask)));
+}
+
+// dst[lane] += x for lanes in mask
+static void LanesAddScalar(void* dst, int x, LaneMask mask)
+{
+	__m256i a = LanesLoadVector(dst);
+	__m256i sum = _mm256_add_epi32(a, _mm256_set1_epi32(x));
+	_mm256_storeu_si256((__m256i*)dst, _mm256_blendv_epi8(a, sum, LaneMaskVector(mask)));
+}
+
+#else
+
+static LaneMask LanesEqual(const void* v, int x, LaneMask mask)
+{
+	const int* lanes = v;
+	LaneMask ret = 0;
+	for (int i = 0; i < LMC_LANES; ++i) ret |= (LaneMask)(lanes[i] == x) << i;
+	return ret & mask;
+}
+
+static LaneMask LanesNonNegative(const void* v, LaneMask mask)
+{
+	const int* lanes = v;
+	LaneMask ret = 0;
+	for (int i = 0; i < LMC_LANES; ++i) ret |= (LaneMask)(lanes[i] >= 0) << i;
+	return ret & mask;
+}
+
+static void LanesCopy(void* dst, const void* src, LaneMask mask)
+{
+	int* d = dst;
+	const int* s = src;
+	for (int i = 0; i < LMC_LANES; ++i) if (mask & (1u << i)) d[i] = s[i];
+}
+
+static void LanesSet(void* dst, int x, LaneMask mask)
+{
+	int* d = dst;
+	for (int i = 0; i < LMC_LANES; ++i) if (mask & (1u << i)) d[i] = x;
+}
+
+static void LanesAdd(void* dst, const void* src, bool subtract, LaneMask mask)
+{
+	unsigned int* d = dst;
+	const unsigned int* s = src;
+	for (int i = 0; i < LMC_LANES; ++i) if (mask & (1u << i)) d[i] = subtract ? d[i] - s[i] : d[i] + s[i];
+}
+
+static void LanesAddScalar(void* dst, int x, LaneMask mask)
+{
+	int* d = dst;
+	for (int i = 0; i < LMC_LANES; ++i) if (mask & (1u << i)) d[i] += x;
+}
+
+#endif
+
+void LanesLoad(LMCLanes* lanes, const LMCContext* code, int count)
+{
+	assert(lanes && code);
+	assert(count >= 0 && count <= LMC_LANES);
+	lanes->laneCount = count;
+	lanes->inpFunction = code->inpFunction;
+	lanes->outFunction = code->outFunction;
+	// unused lanes get a copy too, so they hold valid values and never cause trouble in a vector op
+	for (int lane = 0; lane < LMC_LANES; ++lane)
+	{
+		for (int i = 0; i < 100; ++i) lanes->mailBoxes[i][lane] = code->mailBoxes[i];
+		lanes->accumulator[lane] = code->accumulator;
+		lanes->programCounter[lane] = code->programCounter;
+		lanes->inputCtx[lane] = code->inputCtx;
+		lanes->outputCtx[lane] = code->outputCtx;
+		lanes->executed[lane] = 0;
+		lanes->status[lane] = ERROR_OK;
+	}
+}
+
+void LanesGet(const LMCLanes* lanes, int lane, LMCContext* code)
+{
+	assert(lanes && code);
+	assert(lane >= 0 && lane < LMC_LANES);
+	for (int i = 0; i < 100; ++i) code->mailBoxes[i] = lanes->mailBoxes[i][lane];
+	code->accumulator = lanes->accumulator[lane];
+	code->programCounter = lanes->programCounter[lane];
+	code->inputCtx = lanes->inputCtx[lane];
+	code->outputCtx = lanes->outputCtx[lane];
+	code->inpFunction = lanes->inpFunction;
+	code->outFunction = lanes->outFunction;
+}
+
+void RunLanes(LMCLanes* lanes, long maxSteps)
+{
+	assert(lanes);
+	if (maxSteps < 0) maxSteps = LONG_MAX;
+
+	LaneMask active = 0;
+	for (int lane = 0; lane < lanes->laneCount; ++lane)
+	{
+		lanes->executed[lane] = 0;
+		lanes->status[lane] = ERROR_BUDGET_EXHAUSTED;
+		int pc = lanes->programCounter[lane];
+		if (pc > 99 || pc < 0)
+			lanes->status[lane] = ERROR_BAD_PC;
+		else if (maxSteps > 0)
+			active |= 1u << lane;
+	}
+
+	while (active)
+	{
+		int pc = 100;
+		int leader = 0;
+		for (int lane = 0; lane < LMC_LANES; ++lane)
+		{
+			if ((active & (1u << lane)) && lanes->programCounter[lane] < pc)
+			{
+				pc = lanes->programCounter[lane];
+				leader = lane;
+			}
+		}
+
+		// everyone left fell off the end of memory
+		if (pc > 99)
+		{
+			for (int lane = 0; lane < LMC_LANES; ++lane)
+			{
+				if (active & (1u << lane)) lanes->status[lane] = ERROR_BAD_PC;
+			}
+			break;
+		}
+
+		// self modifying code can leave lanes at the same PC with different instructions
+		int instruction = lanes->mailBoxes[pc][leader];
+		LaneMask group = LanesEqual(lanes->programCounter, pc, active);
+		group = LanesEqual(lanes->mailBoxes[pc], instruction, group);
+		DecodedInstruction in = Decode(instruction);
+		int* operand = lanes->mailBoxes[in.operand];
+
+		switch (in.op)
+		{
+			case OP_ADD:
+			case OP_SUB:
+				LanesAdd(lanes->accumulator, operand, in.op == OP_SUB, group);
+				LanesAddScalar(lanes->programCounter, 1, group);
+				break;
+			case OP_STA:
+				LanesCopy(operand, lanes->accumulator, group);
+				LanesAddScalar(lanes->programCounter, 1, group);
+				break;
+			case OP_LDA:
+				LanesCopy(lanes->accumulator, operand, group);
+				LanesAddScalar(lanes->programCounter, 1, group);
+				break;
+			case OP_BRA:
+				LanesSet(lanes->programCounter, in.operand, group);
+				break;
+			case OP_BRZ:
+			case OP_BRP:
+			{
+				LaneMask taken = in.op == OP_BRZ
+					? LanesEqual(lanes->accumulator, 0, group)
+					: LanesNonNegative(lanes->accumulator, group);
+				LanesSet(lanes->programCounter, in.operand, taken);
+				LanesAddScalar(lanes->programCounter, 1, group & ~taken);
+				break;
+			}
+			case OP_INP:
+			case OP_OUT:
+			case OP_OTC:
+				// callbacks are per lane, there's nothing to vectorize
+				for (int lane = 0; lane < LMC_LANES; ++lane)
+				{
+					if (!(group & (1u << lane))) continue;
+					if (in.op == OP_INP)
+					{
+						int input;
+						if (!lanes->inpFunction || !(*lanes->inpFunction)(&input, lanes->inputCtx[lane]))
+						{
+							lanes->status[lane] = lanes->inpFunction ? ERROR_BAD_INPUT : ERROR_NEED_INPUT;
+							group &= ~(1u << lane);
+							active &= ~(1u << lane);
+							continue;
+						}
+						lanes->accumulator[lane] = input;
+					}
+					else if (in.op == OP_OUT)
+						WriteInteger(lanes->outFunction, lanes->outputCtx[lane], lanes->accumulator[lane]);
+					else
+						WriteChar(lanes->outFunction, lanes->outputCtx[lane], lanes->accumulator[lane]);
+					++lanes->programCounter[lane];
+				}
+				break;
+			default:
+			{
+				RuntimeError error = in.op == OP_HLT ? ERROR_HALT : ERROR_BAD_INSTRUCTION;
+				for (int lane = 0; lane < LMC_LANES; ++lane)
+				{
+					if (group & (1u << lane)) lanes->status[lane] = error;
+				}
+				active &= ~group;
+				group = 0;
+				break;
+			}
+		}
+
+		for (int lane = 0; lane < LMC_LANES; ++lane)
+		{
+			if ((group & (1u << lane)) && ++lanes->executed[lane] == maxSteps)
+				active &= ~(1u << lane);
+		}
+	}
+}
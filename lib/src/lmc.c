@@ -22,6 +22,12 @@
 #include <stdbool.h>
 #include <limits.h>
 
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 static bool s8Equal(s8 a, s8 b)
 {
 	if (a.len != b.len) return false;
@@ -97,57 +103,44 @@ static unsigned char ToUpper(unsigned char c)
 	return c;
 }
 
-static const s8 mnemonics[] = {
-	S("HLT"), // 000
-	S("ADD"), // 1xx
-	S("SUB"), // 2xx
-	S("STA"), // 3xx
-	          // 4xx (unused)
-	S("LDA"), // 5xx
-	S("BRA"), // 6xx
-	S("BRZ"), // 7xx
-	S("BRP"), // 8xx
-	S("INP"), // 901
-	S("OUT"), // 902
-	S("OTC"), // 922
-	S("DAT")
-};
+// Mnemonics are looked up by packing their 3 upper cased bytes into an integer and
+// hashing it into this table. The multiplier was searched for so that no two mnemonics collide,
+// so one comparison decides if a word is a mnemonic
+#define MNEMONIC_KEY(a, b, c) ((unsigned int)(a) | (unsigned int)(b) << 8 | (unsigned int)(c) << 16)
+#define MNEMONIC_HASH(key) (((key) * 38810u) >> 27)
 
-// Give proper forward declarations later
-static bool s8iEqual(s8 a, s8 b);
+typedef struct
+{
+	unsigned int key; // 0 for an empty slot, never matches since mnemonics are 3 letters
+	int value;
+} MnemonicEntry;
+
+static const MnemonicEntry mnemonicTable[32] = {
+	[29] = { MNEMONIC_KEY('H', 'L', 'T'), 000  }, // 000
+	[ 8] = { MNEMONIC_KEY('C', 'O', 'B'), 000  }, // alias for HLT
+	[13] = { MNEMONIC_KEY('A', 'D', 'D'), 100  }, // 1xx
+	[ 9] = { MNEMONIC_KEY('S', 'U', 'B'), 200  }, // 2xx
+	[22] = { MNEMONIC_KEY('S', 'T', 'A'), 300  }, // 3xx
+	[31] = { MNEMONIC_KEY('S', 'T', 'O'), 300  }, // alias for STA
+	                                              // 4xx (unused)
+	[20] = { MNEMONIC_KEY('L', 'D', 'A'), 500  }, // 5xx
+	[21] = { MNEMONIC_KEY('B', 'R', 'A'), 600  }, // 6xx
+	[15] = { MNEMONIC_KEY('B', 'R', 'Z'), 700  }, // 7xx
+	[18] = { MNEMONIC_KEY('B', 'R', 'P'), 800  }, // 8xx
+	[17] = { MNEMONIC_KEY('I', 'N', 'P'), 901  }, // 901
+	[30] = { MNEMONIC_KEY('O', 'U', 'T'), 902  }, // 902
+	[27] = { MNEMONIC_KEY('O', 'T', 'C'), 922  }, // 922
+	[28] = { MNEMONIC_KEY('D', 'A', 'T'), 1000 },
+};
 
 static int GetMnemonicValue(s8 mnemonic)
 {
-	if (false) {}
-
-	else if (s8iEqual(mnemonic, mnemonics[0 ])  // HLT
-		|| s8iEqual(mnemonic, S("COB")))    // COB
-		return 000;
-	else if (s8iEqual(mnemonic, mnemonics[1 ])) // ADD
-		return 100;
-	else if (s8iEqual(mnemonic, mnemonics[2 ])) // SUB
-		return 200;
-	else if (s8iEqual(mnemonic, mnemonics[3 ])  // STA
-		|| s8iEqual(mnemonic, S("STO")))    // STO
-		return 300;
-	else if (s8iEqual(mnemonic, mnemonics[4 ])) // LDA
-		return 500;
-	else if (s8iEqual(mnemonic, mnemonics[5 ])) // BRA
-		return 600;
-	else if (s8iEqual(mnemonic, mnemonics[6 ])) // BRZ
-		return 700;
-	else if (s8iEqual(mnemonic, mnemonics[7 ])) // BRP
-		return 800;
-	else if (s8iEqual(mnemonic, mnemonics[8 ])) // INP
-		return 901;
-	else if (s8iEqual(mnemonic, mnemonics[9 ])) // OUT
-		return 902;
-	else if (s8iEqual(mnemonic, mnemonics[10])) // OTC
-		return 922;
-	else if (s8iEqual(mnemonic, mnemonics[11])) // DAT
-		return 1000;
-	else
+	if (mnemonic.len != 3)
 		return -1;
+
+	unsigned int key = MNEMONIC_KEY(ToUpper(mnemonic.str[0]), ToUpper(mnemonic.str[1]), ToUpper(mnemonic.str[2]));
+	const MnemonicEntry* entry = &mnemonicTable[MNEMONIC_HASH(key)];
+	return entry->key == key ? entry->value : -1;
 }
 
 static bool IsWhitespace(char c)
@@ -155,66 +148,97 @@ static bool IsWhitespace(char c)
 	return ((c == ' ') || (c == '\t') || (c == '\r'));
 }
 
-static s8 StripWhitespace(s8 line)
+// Byte scanning for the assembler front end: index of the first byte of s that is (or with
+// invert, isn't) one of a, b or c, s.len if there isn't one.
+// Compares 32 or 16 bytes at a time where the target has AVX2 or SSE2, the tail is done byte by byte
+static ptrdiff_t FindByte3(s8 s, unsigned char a, unsigned char b, unsigned char c, bool invert)
 {
-	while (line.len > 0 && IsWhitespace(*line.str))
+	ptrdiff_t i = 0;
+
+#if defined(__GNUC__) && defined(__AVX2__)
+	__m256i wideA = _mm256_set1_epi8((char)a);
+	__m256i wideB = _mm256_set1_epi8((char)b);
+	__m256i wideC = _mm256_set1_epi8((char)c);
+	unsigned int wideFlip = invert ? 0xFFFFFFFFu : 0;
+	for (; i + 32 <= s.len; i += 32)
 	{
-		++line.str;
-		--line.len;
+		__m256i v = _mm256_loadu_si256((const __m256i*)(s.str + i));
+		__m256i match = _mm256_or_si256(_mm256_or_si256(
+			_mm256_cmpeq_epi8(v, wideA), _mm256_cmpeq_epi8(v, wideB)), _mm256_cmpeq_epi8(v, wideC));
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(match) ^ wideFlip;
+		if (mask) return i + __builtin_ctz(mask);
 	}
+#endif
 
-	while (line.len > 0 && IsWhitespace(line.str[line.len-1]))
+#if defined(__GNUC__) && defined(__SSE2__)
+	__m128i vecA = _mm_set1_epi8((char)a);
+	__m128i vecB = _mm_set1_epi8((char)b);
+	__m128i vecC = _mm_set1_epi8((char)c);
+	unsigned int flip = invert ? 0xFFFFu : 0;
+	for (; i + 16 <= s.len; i += 16)
 	{
-		--line.len;
+		__m128i v = _mm_loadu_si128((const __m128i*)(s.str + i));
+		__m128i match = _mm_or_si128(_mm_or_si128(
+			_mm_cmpeq_epi8(v, vecA), _mm_cmpeq_epi8(v, vecB)), _mm_cmpeq_epi8(v, vecC));
+		unsigned int mask = (unsigned int)_mm_movemask_epi8(match) ^ flip;
+		if (mask) return i + __builtin_ctz(mask);
 	}
+#endif
 
-	return line;
+	for (; i < s.len; ++i)
+	{
+		unsigned char x = s.str[i];
+		if (((x == a) || (x == b) || (x == c)) != invert)
+			return i;
+	}
+	return s.len;
+}
+
+static s8 SkipWhitespace(s8 s)
+{
+	ptrdiff_t skip = FindByte3(s, ' ', '\t', '\r', true);
+	s.str += skip;
+	s.len -= skip;
+	return s;
 }
 
-static bool IsCommentToken(char c)
+static s8 StripWhitespace(s8 line)
 {
-	return ((c == '#') || (c == '/') || (c == ';'));
+	line = SkipWhitespace(line);
+
+	while (line.len > 0 && IsWhitespace(line.str[line.len-1]))
+	{
+		--line.len;
+	}
+
+	return line;
 }
 
 // Strips comments from the end of the line
 // 3 tokens are supported: // ; #
+// The comment starts at the first token in the line, so it's a forward search
 static s8 StripComment(s8 line)
 {
-	unsigned char* commentPos = 0;
-	bool wasSlash = false;
-
-	for (int i = line.len-1; i >= 0; --i)
+	ptrdiff_t offset = 0;
+	while (offset < line.len)
 	{
-		if (IsCommentToken(line.str[i]))
+		s8 rest = (s8) { line.str + offset, line.len - offset };
+		ptrdiff_t i = offset + FindByte3(rest, '#', ';', '/', false);
+		if (i == line.len)
+			break;
+
+		// a single / isn't a comment
+		if (line.str[i] != '/' || (i+1 < line.len && line.str[i+1] == '/'))
 		{
-			unsigned char* end = line.str + i;
-			if (line.str[i] == '/')
-			{
-				if (wasSlash)
-					commentPos = end;
-				else
-					wasSlash = true;
-			}
-			else
-			{
-				commentPos = end;
-				wasSlash = false;
-			}
+			line.len = i;
+			break;
 		}
-		else wasSlash = false;
+		offset = i+1;
 	}
 
-	if (commentPos)
-		line.len -= (line.str + line.len) - commentPos;
-
 	return line;
 }
 
-static bool IsNewline(char c)
-{
-	return ((c == '\n') || (c == '\r'));
-}
-
 // Extract next line of "buf". Modifies buf to point to the next line too, so it can be called repeatedly until it returns an empty string
 static s8 GetLine(s8* buf)
 {
@@ -233,22 +257,11 @@ static s8 GetLine(s8* buf)
 	}
 
 	// Find the next newline, and end the string before it
-	for (int i = 0; i < buf->len; ++i)
-	{
-		if (IsNewline(buf->str[i]))
-		{
-			s8 ret;
-			ret.str = buf->str;
-			ret.len = i;
-			// Remove returned line from buf
-			buf->len -= ret.len;
-			buf->str += ret.len;
-			return ret;
-		}
-	}
-
-	// No newline found - last line or EOF
-	s8 ret = *buf;
+	// No newline found is the last line or EOF, which is the rest of buf
+	s8 ret;
+	ret.str = buf->str;
+	ret.len = FindByte3(*buf, '\n', '\r', '\r', false);
+	// Remove returned line from buf
 	buf->len -= ret.len;
 	buf->str += ret.len;
 	return ret;
@@ -259,36 +272,21 @@ static s8 GetWord(s8* line)
 	assert(line);
 
 	// skip over leading whitespace
-	while (line->len > 0 && IsWhitespace(*line->str))
-	{
-		++line->str;
-		--line->len;
-	}
-
+	*line = SkipWhitespace(*line);
 
 	// Find the next whitespace, and end the string before it
-	for (int i = 0; i < line->len; ++i)
-	{
-		if (IsWhitespace(line->str[i]))
-		{
-			s8 ret;
-			ret.str = line->str;
-			ret.len = i;
-			// Remove returned word from line
-			line->len -= ret.len;
-			line->str += ret.len;
-			return ret;
-		}
-	}
-
-	// No whitespace found - last word or end of line
-	s8 ret = *line;
+	// No whitespace found is the last word or end of line
+	s8 ret;
+	ret.str = line->str;
+	ret.len = FindByte3(*line, ' ', '\t', '\r', false);
+	// Remove returned word from line
 	line->len -= ret.len;
 	line->str += ret.len;
 	return ret;
 }
 
-// Case insensitive comparison
+#ifdef TEST
+// Case insensitive comparison, the tests check the keyword lookup against it
 static bool s8iEqual(s8 a, s8 b)
 {
 	if (a.len != b.len) return false;
@@ -300,6 +298,7 @@ static bool s8iEqual(s8 a, s8 b)
 
 	return true;
 }
+#endif
 
 typedef struct
 {
@@ -307,6 +306,68 @@ typedef struct
 	int value;
 } LabelInfo;
 
+// There can't be more labels than mailboxes, so a table of twice that never fills up
+#define LABEL_TABLE_SIZE 256
+
+// Open addressing hash table of labels, an empty label marks a free slot
+typedef struct
+{
+	LabelInfo slots[LABEL_TABLE_SIZE];
+} LabelTable;
+
+static unsigned int HashLabel(s8 label)
+{
+	// FNV-1a
+	unsigned int hash = 2166136261u;
+	for (ptrdiff_t i = 0; i < label.len; ++i)
+	{
+		hash ^= label.str[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Returns the slot holding label, or the free slot it would go in
+static LabelInfo* LabelTableFind(LabelTable* table, s8 label)
+{
+	unsigned int i = HashLabel(label);
+	for (;;)
+	{
+		LabelInfo* slot = &table->slots[i % LABEL_TABLE_SIZE];
+		if (slot->label.len == 0 || s8Equal(slot->label, label))
+			return slot;
+		++i;
+	}
+}
+
+// A label used before it was defined, patched into its mailbox once all lines are read
+typedef struct
+{
+	s8 label;
+	int mailbox;
+	int lineNumber;
+	bool takesAddress;
+} LabelFixup;
+
+// The assembler used to make two passes, and errors found while placing labels (first pass) were reported
+// before errors in operands (second pass), regardless of line. Operand errors are remembered instead of
+// returned, so the same error still wins
+typedef enum
+{
+	OPERAND_OK,
+	OPERAND_TAKES_NO_ADDRESS,
+	OPERAND_UNDEFINED_LABEL,
+	OPERAND_OUT_OF_RANGE,
+	OPERAND_JUNK,
+} OperandError;
+
+typedef struct
+{
+	OperandError error;
+	int lineNumber;
+	s8 word;
+} PendingOperandError;
+
 typedef struct {
 	unsigned char* buf;
 	int capacity;
@@ -363,37 +424,59 @@ static void appendChar(buf* buffer, unsigned char c)
 	append(buffer, &c, 1);
 }
 
+// A buf over whatever space is left in the arena
+static buf bufFromArena(Arena* arena)
+{
+	buf buffer;
+	ptrdiff_t available = arena ? arena->end - arena->beg : 0;
+	buffer.buf = arena ? arena->beg : 0;
+	buffer.capacity = available > INT_MAX ? INT_MAX : (int)available;
+	buffer.len = 0;
+	buffer.error = 0;
+	return buffer;
+}
+
+// Keeps what was written to buffer, by moving the arena past it
+static s8 bufToArena(buf* buffer, Arena* arena)
+{
+	if (arena) arena->beg += buffer->len;
+	return bufTos8(buffer);
+}
+
+static void SetPendingError(PendingOperandError* pending, OperandError error, int lineNumber, s8 word)
+{
+	// only the first one counts, lines are read in order
+	if (pending->error != OPERAND_OK) return;
+	pending->error = error;
+	pending->lineNumber = lineNumber;
+	pending->word = word;
+}
+
 // Perhaps this return value is not well designed... it just makes the allocation the responsibility of other code
 // and can't return an error message with more than one "context"
 // Shouldn't be too hard to refactor if it becomes a problem
-AssemblerError Assemble(s8 assembly, LMCContext* code, bool strict)
+AssemblerError AssembleLines(s8 assembly, LMCContext* code, bool strict, Arena* arena, int* lines)
 {
 	assert(code);
 	for (int i = 0; i < 100; ++i) code->mailBoxes[i] = 0;
+	if (lines) for (int i = 0; i < 100; ++i) lines[i] = 0;
 
-	// static buffer to hold error messages
-	// could allocate out of a passed arena, but that would be extra effort for callers
-	// I think static is okay for this case
-	static unsigned char mem[1<<14];
-	buf buffer;
-	buffer.buf = &mem[0];
-	buffer.capacity = sizeof(mem);
-	buffer.len = 0;
-	buffer.error = 0;
+	// error messages are allocated out of the caller's arena
+	buf buffer = bufFromArena(arena);
+
+	LabelTable labels;
+	for (int i = 0; i < LABEL_TABLE_SIZE; ++i) labels.slots[i].label.len = 0;
+
+	LabelFixup fixups[100];
+	int fixupCount = 0;
 
-	LabelInfo labels[100];
-	int labelCount = 0;
+	PendingOperandError pending = { OPERAND_OK, 0, {0, 0} };
 
 	int lineNumber = 0;
 	int currentInstructionPointer = 0;
-	s8 save = assembly;
-
-	// First loop is to get all labels
-	// searches for lines in the format <label> <mnemonic> <opcode>
-	// <label> is optional
-	// insert their address into a an array
-	// TODO: replace this with a hash map for better efficiency
-	// currently, naive O(n) lookup is done every time it's needed
+
+	// Single pass over the source: labels go in the hash table as they're defined,
+	// references to labels that aren't defined yet are patched at the end
 	while(!s8Equal(assembly, S(""))) // empty string is EOF
 	{
 		++lineNumber;
@@ -404,168 +487,92 @@ AssemblerError Assemble(s8 assembly, LMCContext* code, bool strict)
 		s8 line = GetLine(&assembly);
 		line = StripComment(line);
 		line = StripWhitespace(line);
-		s8 label = GetWord(&line);
+		s8 word = GetWord(&line);
 		// empty line
-		if (s8Equal(label, S("")))
+		if (s8Equal(word, S("")))
 			continue;
 
-		if (GetMnemonicValue(label) == -1) // first word of line is not a known mnemonic
+		int opcode = GetMnemonicValue(word);
+		if (opcode == -1) // first word of line is not a known mnemonic
 		{
-			if (GetMnemonicValue(GetWord(&line)) != -1) // second word is a known mnemonic - first word is a label
-			{
-				bool labelRedefined = false;
-				// Search if label has been defined already
-				for (int i = 0; i < labelCount; ++i)
-				{
-					if (s8Equal(labels[i].label, label))
-					{
-						// label redefined
-						// TODO implement proper error return
-						// NOTE: Peter Higginson LMC is fine
-						// with redefining labels - it just uses the first definition it finds as the value
-						// lmc.awk has a specific error for it. I decided to implement it as an error only if
-						// strict mode is enabled
-						if (strict)
-						{
-							AssemblerError ret;
-							ret.lineNumber = lineNumber;
-							appends8(&buffer, S("label \""));
-							appends8(&buffer, label);
-							appends8(&buffer, S("\" redefined"));
-							ret.message = bufTos8(&buffer);
-							return ret;
-						}
-						labelRedefined = true;
-					}
-				}
-
-				if (!labelRedefined)
-				{
-					LabelInfo tmp;
-					tmp.label = label;
-					tmp.value = currentInstructionPointer++;
-					labels[labelCount++] = tmp;
-				}
-				else
-				{
-					++currentInstructionPointer;
-				}
-			}
-			else
+			s8 label = word;
+			word = GetWord(&line);
+			opcode = GetMnemonicValue(word);
+			if (opcode == -1)
 			{
+				// second word is not a mnemonic either - can't be a label
 				AssemblerError ret;
 				ret.lineNumber = lineNumber;
 				appends8(&buffer, S("unknown instruction \""));
 				appends8(&buffer, label);
 				appends8(&buffer, S("\""));
-				ret.message = bufTos8(&buffer);
+				ret.message = bufToArena(&buffer, arena);
 				return ret;
 			}
-		}
-		else
-		{
-			++currentInstructionPointer;
-		}
-	} 
-
-	if (strict && currentInstructionPointer > 99)
-	{
-		// Peter Higginson LMC does not care about this, but lmc.awk does
-		// so, only check in strict mode
-		AssemblerError ret;
-		ret.lineNumber = lineNumber;
-		// The previous loop breaks when currentInstructionPointer > 99
-		// So, I can't write many instructions were in the program without some refactoring
-		// maybe a TODO, or more likely a waste of time.
-		appends8(&buffer, S("program contains more than 100 instructions."));
-		ret.message = bufTos8(&buffer);
-		return ret;
-	}
-
 
-	lineNumber = 0;
-	currentInstructionPointer = 0;
-	assembly = save;
-
-	while (!s8Equal(assembly, S("")))
-	{
-		++lineNumber;
+			LabelInfo* slot = LabelTableFind(&labels, label);
+			if (slot->label.len != 0)
+			{
+				// label redefined
+				// NOTE: Peter Higginson LMC is fine
+				// with redefining labels - it just uses the first definition it finds as the value
+				// lmc.awk has a specific error for it. I decided to implement it as an error only if
+				// strict mode is enabled
+				if (strict)
+				{
+					AssemblerError ret;
+					ret.lineNumber = lineNumber;
+					appends8(&buffer, S("label \""));
+					appends8(&buffer, label);
+					appends8(&buffer, S("\" redefined"));
+					ret.message = bufToArena(&buffer, arena);
+					return ret;
+				}
+			}
+			else
+			{
+				slot->label = label;
+				slot->value = currentInstructionPointer;
+			}
+		}
 
-		s8 line = GetLine(&assembly);
-		line = StripComment(line);
-		line = StripWhitespace(line);
-		s8 word = GetWord(&line);
+		int mailbox = currentInstructionPointer++;
+		if (lines) lines[mailbox] = lineNumber;
 
-		if (s8Equal(word, S("")))
-		{
+		// Operand errors don't stop the pass, a label error further down still has to be found first
+		if (pending.error != OPERAND_OK)
 			continue;
-		}
-		int opcode = GetMnemonicValue(word);
-		if (opcode == -1)
-		{
-			// first word was not a valid mnemonic, so probably a label
-			word = GetWord(&line);
-			opcode = GetMnemonicValue(word);
-		}
 
-		if (opcode == -1)
-		{
-			// second word is still not a valid mnemonic - can't be a label, either
-			AssemblerError ret;
-			ret.lineNumber = lineNumber;
-			appends8(&buffer, S("unknown instruction \""));
-			appends8(&buffer, word);
-			appends8(&buffer, S("\""));
-			ret.message = bufTos8(&buffer);
-			return ret;
-		}
 		bool takesAddress = ((opcode != 0) && (opcode % 100 == 0));
 		s8 tmp = GetWord(&line);
 		if (strict && !takesAddress && !s8Equal(tmp, S("")))
 		{
 			// Peter higginson LMC and lmc.awk don't care about this, so the check is "opt-in" for strict only
-			AssemblerError ret;
-			ret.lineNumber = lineNumber;
-			appends8(&buffer, S("instruction \""));
-			appends8(&buffer, word);
-			appends8(&buffer, S("\" does not take an address"));
-			ret.message = bufTos8(&buffer);
-			return ret;
+			SetPendingError(&pending, OPERAND_TAKES_NO_ADDRESS, lineNumber, word);
+			continue;
 		}
 		int address = 0;
+		bool needsFixup = false;
 		IntegerInputError error = s8ToInteger(tmp, &address);
 		if (error == NOT_A_NUMBER)
 		{
-			bool labelFound = false;
-			for (int i = 0; i < labelCount; ++i)
+			LabelInfo* slot = LabelTableFind(&labels, tmp);
+			if (slot->label.len != 0)
 			{
-				if (s8Equal(labels[i].label, tmp))
-				{
-					labelFound = true;
-					address = takesAddress ? labels[i].value : 0;
-				}
+				address = slot->value;
 			}
-			if (!labelFound)
+			else
 			{
-				AssemblerError ret;
-				ret.lineNumber = lineNumber;
-				appends8(&buffer, S("undefined address label \""));
-				appends8(&buffer, tmp);
-				appends8(&buffer, S("\""));
-				ret.message = bufTos8(&buffer);
-				return ret;
+				// might be defined further down
+				needsFixup = true;
+				address = 0;
 			}
 		}
 		// Don't allow address values outside of 0-99, except for usage with DAT
 		else if (error == NOT_IN_RANGE || ((address < 0 || address > 99) && (opcode != 1000)))
 		{
-			AssemblerError ret;
-			ret.lineNumber = lineNumber;
-			appends8(&buffer, S("address label \""));
-			appends8(&buffer, tmp);
-			appends8(&buffer, S("\" is out of range [0, 100)"));
-			ret.message = bufTos8(&buffer);
-			return ret;
+			SetPendingError(&pending, OPERAND_OUT_OF_RANGE, lineNumber, tmp);
+			continue;
 		}
 
 		if (strict)
@@ -575,25 +582,141 @@ AssemblerError Assemble(s8 assembly, LMCContext* code, bool strict)
 			line.len += junk.len;
 			if (!s8Equal(line, S("")))
 			{
-				AssemblerError ret;
-				ret.lineNumber = lineNumber;
-				appends8(&buffer, S("junk \""));
-				appends8(&buffer, line);
-				appends8(&buffer, S("\" found after address"));
-				ret.message = bufTos8(&buffer);
-				return ret;
+				// an undefined label on this line is reported instead, when the fixups are resolved
+				SetPendingError(&pending, OPERAND_JUNK, lineNumber, line);
 			}
 		}
 
+		if (needsFixup)
+		{
+			LabelFixup* fixup = &fixups[fixupCount++];
+			fixup->label = tmp;
+			fixup->mailbox = mailbox;
+			fixup->lineNumber = lineNumber;
+			fixup->takesAddress = takesAddress;
+		}
+
 		// handle DAT
 		if (opcode == 1000) opcode = 0;
 		if (!takesAddress) address = 0;
-		code->mailBoxes[currentInstructionPointer++] = opcode + address;
+		code->mailBoxes[mailbox] = opcode + address;
+	}
+
+	if (strict && currentInstructionPointer > 99)
+	{
+		// Peter Higginson LMC does not care about this, but lmc.awk does
+		// so, only check in strict mode
+		AssemblerError ret;
+		ret.lineNumber = lineNumber;
+		// The loop breaks when currentInstructionPointer > 99
+		// So, I can't write many instructions were in the program without some refactoring
+		// maybe a TODO, or more likely a waste of time.
+		appends8(&buffer, S("program contains more than 100 instructions."));
+		ret.message = bufToArena(&buffer, arena);
+		return ret;
+	}
+
+	for (int i = 0; i < fixupCount; ++i)
+	{
+		LabelFixup* fixup = &fixups[i];
+		// fixups after the first operand error don't matter, its line is earlier
+		if (pending.error != OPERAND_OK && fixup->lineNumber > pending.lineNumber)
+			break;
+
+		LabelInfo* slot = LabelTableFind(&labels, fixup->label);
+		if (slot->label.len == 0)
+		{
+			// on the same line, the undefined label was found before any junk
+			pending.error = OPERAND_UNDEFINED_LABEL;
+			pending.lineNumber = fixup->lineNumber;
+			pending.word = fixup->label;
+			break;
+		}
+		if (fixup->takesAddress) code->mailBoxes[fixup->mailbox] += slot->value;
+	}
+
+	if (pending.error != OPERAND_OK)
+	{
+		AssemblerError ret;
+		ret.lineNumber = pending.lineNumber;
+		switch (pending.error)
+		{
+			case OPERAND_TAKES_NO_ADDRESS:
+				appends8(&buffer, S("instruction \""));
+				appends8(&buffer, pending.word);
+				appends8(&buffer, S("\" does not take an address"));
+				break;
+			case OPERAND_UNDEFINED_LABEL:
+				appends8(&buffer, S("undefined address label \""));
+				appends8(&buffer, pending.word);
+				appends8(&buffer, S("\""));
+				break;
+			case OPERAND_OUT_OF_RANGE:
+				appends8(&buffer, S("address label \""));
+				appends8(&buffer, pending.word);
+				appends8(&buffer, S("\" is out of range [0, 100)"));
+				break;
+			case OPERAND_JUNK:
+				appends8(&buffer, S("junk \""));
+				appends8(&buffer, pending.word);
+				appends8(&buffer, S("\" found after address"));
+				break;
+			default:
+				break;
+		}
+		ret.message = bufToArena(&buffer, arena);
+		return ret;
 	}
 
 	return (AssemblerError){ -1, {0,0} };
 }
 
+AssemblerError AssembleArena(s8 assembly, LMCContext* code, bool strict, Arena* arena)
+{
+	return AssembleLines(assembly, code, strict, arena, 0);
+}
+
+AssemblerError Assemble(s8 assembly, LMCContext* code, bool strict)
+{
+	// thread local, so threads using the old API don't overwrite each other's messages
+	static _Thread_local unsigned char mem[1<<14];
+	Arena arena = { &mem[0], &mem[sizeof(mem)] };
+	return AssembleArena(assembly, code, strict, &arena);
+}
+
+// Shared by every engine so they all produce identical output
+static void WriteInteger(OutCallback outFunction, void* outputCtx, unsigned int accumulator)
+{
+	unsigned char mem[12];
+	buf buffer;
+	buffer.buf = &mem[0];
+	buffer.capacity = sizeof(mem);
+	buffer.len = 0;
+	buffer.error = 0;
+
+	appendInteger(&buffer, (int)accumulator);
+	appendChar(&buffer, '\n');
+	s8 s = bufTos8(&buffer);
+
+	(*outFunction)(s.str, s.len, outputCtx);
+}
+
+static void WriteChar(OutCallback outFunction, void* outputCtx, unsigned int accumulator)
+{
+	unsigned char c = accumulator;
+	(*outFunction)(&c, 1, outputCtx);
+}
+
+static void OutputInteger(LMCContext* code, unsigned int accumulator)
+{
+	WriteInteger(code->outFunction, code->outputCtx, accumulator);
+}
+
+static void OutputChar(LMCContext* code, unsigned int accumulator)
+{
+	WriteChar(code->outFunction, code->outputCtx, accumulator);
+}
+
 RuntimeError Step(LMCContext* code)
 {
 
@@ -674,6 +797,7 @@ RuntimeError Step(LMCContext* code)
 		// Need some ideas on how to get it - maybe use function pointer callbacks???
 		if (operand == 1) // INP
 		{
+			if (!code->inpFunction) return ERROR_NEED_INPUT;
 			int input;
 			bool didParse = (*code->inpFunction)(&input, code->inputCtx);
 			if (didParse)
@@ -689,25 +813,12 @@ RuntimeError Step(LMCContext* code)
 
 		else if (operand == 2) // OUT
 		{
-			unsigned char mem[12];
-			buf buffer;
-			buffer.buf = &mem[0];
-			buffer.capacity = sizeof(mem);
-			buffer.len = 0;
-			buffer.error = 0;
-
-			appendInteger(&buffer, (int)code->accumulator);
-			appendChar(&buffer, '\n');
-			s8 s = bufTos8(&buffer);
-
-			(*code->outFunction)(s.str, s.len, code->outputCtx);
+			OutputInteger(code, code->accumulator);
 		}
 
 		else if (operand == 22) // OTC
 		{
-			unsigned char c = code->accumulator;
-			s8 s = (s8){&c, 1};
-			(*code->outFunction)(s.str, s.len, code->inputCtx);
+			OutputChar(code, code->accumulator);
 		}
 		else
 		{
@@ -726,20 +837,490 @@ RuntimeError Step(LMCContext* code)
 	return ret;
 }
 
-s8 RuntimeError_StrError(LMCContext* code, RuntimeError error)
+RuntimeError ProvideInput(LMCContext* code, int input)
 {
-	static unsigned char mem[60];
-	buf buffer;
-	buffer.buf = &mem[0];
-	buffer.capacity = sizeof(mem);
-	buffer.len = 0;
-	buffer.error = 0;
-
-	switch (error)
+	if (code->programCounter > 99 || code->programCounter < 0)
 	{
-		case ERROR_OK:
-			return (s8) { 0, 0 }; // no error to report
-		case ERROR_HALT:
+		return ERROR_BAD_PC;
+	}
+	if (code->mailBoxes[code->programCounter] != 901)
+	{
+		return ERROR_BAD_INSTRUCTION;
+	}
+
+	code->accumulator = input;
+	++code->programCounter;
+	return ERROR_OK;
+}
+
+// Instruction kinds after predecoding - Run() dispatches on these instead of
+// redoing the /100 and %100 and the if/else chain from Step() every cycle
+typedef enum
+{
+	OP_HLT,
+	OP_ADD,
+	OP_SUB,
+	OP_STA,
+	OP_LDA,
+	OP_BRA,
+	OP_BRZ,
+	OP_BRP,
+	OP_INP,
+	OP_OUT,
+	OP_OTC,
+	OP_BAD, // anything Step() would report as ERROR_BAD_INSTRUCTION
+	OP_BAD_PC, // sentinel one past the last mailbox, so falling off the end needs no extra check
+	// superinstructions, only Run() makes these - see Fuse()
+	OP_LDA_ADD_STA,
+	OP_LDA_SUB_STA,
+	OP_LDA_SUB_BRZ,
+	OP_LDA_SUB_BRP,
+	OP_INP_STA,
+	OP_COUNT
+} Opcode;
+
+typedef struct
+{
+	unsigned char op;
+	unsigned char operand;
+} DecodedInstruction;
+
+// Must agree with Step() for every possible mailbox value, including garbage
+// left behind by STA (negative numbers, values >= 1000 etc)
+static DecodedInstruction Decode(int instruction)
+{
+	DecodedInstruction ret = { OP_BAD, 0 };
+	if (instruction == 0)
+	{
+		ret.op = OP_HLT;
+		return ret;
+	}
+
+	int opcode = instruction / 100;
+	int operand = instruction % 100;
+	// negative instructions give a negative opcode or operand - never valid
+	if (operand < 0) return ret;
+
+	switch (opcode)
+	{
+		case 1: ret.op = OP_ADD; break;
+		case 2: ret.op = OP_SUB; break;
+		case 3: ret.op = OP_STA; break;
+		case 5: ret.op = OP_LDA; break;
+		case 6: ret.op = OP_BRA; break;
+		case 7: ret.op = OP_BRZ; break;
+		case 8: ret.op = OP_BRP; break;
+		case 9:
+			if (operand == 1) ret.op = OP_INP;
+			else if (operand == 2) ret.op = OP_OUT;
+			else if (operand == 22) ret.op = OP_OTC;
+			return ret;
+		default:
+			return ret;
+	}
+	ret.operand = operand;
+	return ret;
+}
+
+// Instructions that can't fall through to the next mailbox end a straight-line block
+#define BLOCK_ENDS (1u << OP_BRA | 1u << OP_BRZ | 1u << OP_BRP | 1u << OP_HLT | 1u << OP_BAD | 1u << OP_BAD_PC)
+
+static bool EndsBlock(unsigned char op)
+{
+	return (BLOCK_ENDS >> op) & 1;
+}
+
+// Block lengths depend on the mailboxes after them, so a changed mailbox only affects the ones before it,
+// and only up to the first one that comes out the same
+static void RecountBlocks(const DecodedInstruction* decoded, unsigned char* blockLength, int from)
+{
+	for (int i = from; i >= 0; --i)
+	{
+		unsigned char length = EndsBlock(decoded[i].op) ? 1 : blockLength[i+1] + 1;
+		if (i < from && length == blockLength[i]) break;
+		blockLength[i] = length;
+	}
+}
+
+// Common idioms run as one handler. A superinstruction replaces only the op of its first mailbox, the
+// rest keep their own decoding: a branch into the middle of a sequence just runs the plain instructions
+// from there, and the fused handler reads the later operands out of decoded[] as it goes.
+// So a sequence only has to be looked at again when an STA changes the kind of one of its instructions
+static void Fuse(DecodedInstruction* decoded, const int* mailBoxes, int head)
+{
+	if (head < 0 || head > 99) return;
+	DecodedInstruction first = Decode(mailBoxes[head]);
+	unsigned char second = head < 99 ? decoded[head+1].op : OP_BAD_PC;
+	unsigned char third = head < 98 ? decoded[head+2].op : OP_BAD_PC;
+
+	if (first.op == OP_LDA && second == OP_ADD && third == OP_STA) first.op = OP_LDA_ADD_STA;
+	else if (first.op == OP_LDA && second == OP_SUB && third == OP_STA) first.op = OP_LDA_SUB_STA;
+	else if (first.op == OP_LDA && second == OP_SUB && third == OP_BRZ) first.op = OP_LDA_SUB_BRZ;
+	else if (first.op == OP_LDA && second == OP_SUB && third == OP_BRP) first.op = OP_LDA_SUB_BRP;
+	else if (first.op == OP_INP && second == OP_STA) first.op = OP_INP_STA;
+	decoded[head] = first;
+}
+
+// What a superinstruction's first mailbox holds on its own
+static unsigned char UnfusedOp(unsigned char op)
+{
+	if (op == OP_INP_STA) return OP_INP;
+	if (op >= OP_LDA_ADD_STA) return OP_LDA;
+	return op;
+}
+
+// Brings decoded[] and blockLength[] up to date after a mailbox was written outside op_sta
+static void Redecode(DecodedInstruction* decoded, unsigned char* blockLength, const int* mailBoxes, int written)
+{
+	DecodedInstruction now = Decode(mailBoxes[written]);
+	DecodedInstruction* old = &decoded[written];
+	if (now.op == UnfusedOp(old->op))
+	{
+		old->operand = now.operand;
+		return;
+	}
+
+	bool reshaped = EndsBlock(now.op) != EndsBlock(old->op);
+	*old = now;
+	Fuse(decoded, mailBoxes, written - 2);
+	Fuse(decoded, mailBoxes, written - 1);
+	Fuse(decoded, mailBoxes, written);
+	if (reshaped) RecountBlocks(decoded, blockLength, written);
+}
+
+#include "accelerate.c"
+
+RuntimeError Run(LMCContext* code, long maxSteps, long* executed)
+{
+	assert(code);
+
+	// one extra slot for OP_BAD_PC, reached when the PC increments past 99
+	DecodedInstruction decoded[101];
+	for (int i = 0; i < 100; ++i)
+	{
+		decoded[i] = Decode(code->mailBoxes[i]);
+	}
+	decoded[100] = (DecodedInstruction){ OP_BAD_PC, 0 };
+	for (int i = 0; i < 100; ++i)
+	{
+		Fuse(decoded, code->mailBoxes, i);
+	}
+
+	// The budget is charged a whole block at a time: blockLength[i] is the number of instructions from i
+	// up to and including the next one that ends a block, so straight-line code runs without checking it.
+	// Stopping partway through a block gives back the part that didn't run, which is blockLength[pc] again
+	unsigned char blockLength[101];
+	blockLength[100] = 1;
+	for (int i = 99; i >= 0; --i)
+	{
+		blockLength[i] = EndsBlock(decoded[i].op) ? 1 : blockLength[i+1] + 1;
+	}
+
+	// A loop head gets looked at by AccelerateLoop() once a branch back to it has been taken loopAttempt[head]
+	// times, and waits twice as long for the next try every time the loop turns out not to be one it handles
+	unsigned short backEdges[100] = {0};
+	unsigned short loopAttempt[100];
+	for (int i = 0; i < 100; ++i) loopAttempt[i] = 16;
+
+	if (maxSteps < 0) maxSteps = LONG_MAX;
+
+	// Keep the hot state in locals so the compiler can hold it in registers,
+	// it's written back to code before every callback and on exit
+	int* mailBoxes = code->mailBoxes;
+	unsigned int accumulator = code->accumulator;
+	int pc = code->programCounter;
+	long remaining = maxSteps; // budget not charged yet
+	RuntimeError ret = ERROR_OK;
+	DecodedInstruction in;
+
+	if (pc > 99 || pc < 0)
+	{
+		ret = ERROR_BAD_PC;
+		goto done;
+	}
+
+#ifdef __GNUC__
+	// direct threaded dispatch with computed goto, every handler jumps straight to the next one
+	static void* const handlers[OP_COUNT] = {
+		[OP_HLT] = &&op_hlt,
+		[OP_ADD] = &&op_add,
+		[OP_SUB] = &&op_sub,
+		[OP_STA] = &&op_sta,
+		[OP_LDA] = &&op_lda,
+		[OP_BRA] = &&op_bra,
+		[OP_BRZ] = &&op_brz,
+		[OP_BRP] = &&op_brp,
+		[OP_INP] = &&op_inp,
+		[OP_OUT] = &&op_out,
+		[OP_OTC] = &&op_otc,
+		[OP_BAD] = &&op_bad,
+		[OP_BAD_PC] = &&op_bad_pc,
+		[OP_LDA_ADD_STA] = &&op_lda_add_sta,
+		[OP_LDA_SUB_STA] = &&op_lda_sub_sta,
+		[OP_LDA_SUB_BRZ] = &&op_lda_sub_brz,
+		[OP_LDA_SUB_BRP] = &&op_lda_sub_brp,
+		[OP_INP_STA] = &&op_inp_sta,
+	};
+	#define DISPATCH() do { \
+		in = decoded[pc]; \
+		goto *handlers[in.op]; \
+	} while (0)
+#else
+	// no computed goto (MSVC), so fall back to a single switch
+	#define DISPATCH() goto dispatch
+dispatch:
+	in = decoded[pc];
+	switch (in.op)
+	{
+		case OP_HLT: goto op_hlt;
+		case OP_ADD: goto op_add;
+		case OP_SUB: goto op_sub;
+		case OP_STA: goto op_sta;
+		case OP_LDA: goto op_lda;
+		case OP_BRA: goto op_bra;
+		case OP_BRZ: goto op_brz;
+		case OP_BRP: goto op_brp;
+		case OP_INP: goto op_inp;
+		case OP_OUT: goto op_out;
+		case OP_OTC: goto op_otc;
+		case OP_BAD: goto op_bad;
+		case OP_LDA_ADD_STA: goto op_lda_add_sta;
+		case OP_LDA_SUB_STA: goto op_lda_sub_sta;
+		case OP_LDA_SUB_BRZ: goto op_lda_sub_brz;
+		case OP_LDA_SUB_BRP: goto op_lda_sub_brp;
+		case OP_INP_STA: goto op_inp_sta;
+		default: goto op_bad_pc;
+	}
+#endif
+
+	// start of a block: the only place the budget is checked
+	#define BLOCK() do { \
+		if (blockLength[pc] > remaining) goto tail; \
+		remaining -= blockLength[pc]; \
+		DISPATCH(); \
+	} while (0)
+
+	// a taken branch that goes backwards is a loop going round again
+	#define BACK_EDGE() do { \
+		if (in.operand <= pc && ++backEdges[in.operand] == loopAttempt[in.operand]) goto accelerate; \
+	} while (0)
+
+	BLOCK();
+
+op_add:
+	accumulator += mailBoxes[in.operand];
+	++pc;
+	DISPATCH();
+
+op_sub:
+	accumulator -= mailBoxes[in.operand];
+	++pc;
+	DISPATCH();
+
+op_sta:
+	mailBoxes[in.operand] = accumulator;
+	{
+		// self modifying code - only the mailbox that was written needs decoding again
+		DecodedInstruction written = Decode(accumulator);
+		DecodedInstruction* old = &decoded[in.operand];
+		++pc;
+		// the usual case, data that's never executed: same kind of instruction, only the operand changes
+		if (written.op == UnfusedOp(old->op))
+		{
+			old->operand = written.operand;
+			DISPATCH();
+		}
+
+		bool reshaped = EndsBlock(written.op) != EndsBlock(old->op);
+		*old = written;
+		// the sequences this mailbox can be part of
+		Fuse(decoded, mailBoxes, in.operand - 2);
+		Fuse(decoded, mailBoxes, in.operand - 1);
+		Fuse(decoded, mailBoxes, in.operand);
+		if (reshaped)
+		{
+			// block boundaries moved, maybe inside this one - give back the rest of it and recharge
+			remaining += blockLength[pc];
+			RecountBlocks(decoded, blockLength, in.operand);
+			BLOCK();
+		}
+	}
+	DISPATCH();
+
+op_lda:
+	accumulator = mailBoxes[in.operand];
+	++pc;
+	DISPATCH();
+
+op_bra:
+	BACK_EDGE();
+	pc = in.operand;
+	BLOCK();
+
+op_brz:
+	if (accumulator != 0)
+	{
+		++pc;
+		BLOCK();
+	}
+	BACK_EDGE();
+	pc = in.operand;
+	BLOCK();
+
+op_brp:
+	if ((int)accumulator < 0)
+	{
+		++pc;
+		BLOCK();
+	}
+	BACK_EDGE();
+	pc = in.operand;
+	BLOCK();
+
+accelerate:
+	pc = in.operand;
+	backEdges[pc] = 0;
+	{
+		unsigned char changed[100];
+		int changedCount;
+		long skipped = AccelerateLoop(mailBoxes, &accumulator, pc, remaining, changed, &changedCount);
+		if (skipped == 0 && loopAttempt[pc] < 0x8000) loopAttempt[pc] *= 2;
+		remaining -= skipped;
+		for (int i = 0; i < changedCount; ++i)
+		{
+			Redecode(decoded, blockLength, mailBoxes, changed[i]);
+		}
+	}
+	BLOCK();
+
+op_inp:
+	{
+		code->accumulator = accumulator;
+		code->programCounter = pc;
+		if (!code->inpFunction)
+		{
+			ret = ERROR_NEED_INPUT;
+			goto refund;
+		}
+		int input;
+		if (!(*code->inpFunction)(&input, code->inputCtx))
+		{
+			ret = ERROR_BAD_INPUT;
+			goto refund;
+		}
+		accumulator = input;
+	}
+	++pc;
+	DISPATCH();
+
+op_out:
+	code->accumulator = accumulator;
+	code->programCounter = pc;
+	OutputInteger(code, accumulator);
+	++pc;
+	DISPATCH();
+
+op_otc:
+	code->accumulator = accumulator;
+	code->programCounter = pc;
+	OutputChar(code, accumulator);
+	++pc;
+	DISPATCH();
+
+// superinstructions finish with the plain handler of their last instruction
+op_lda_add_sta:
+	accumulator = (unsigned int)mailBoxes[in.operand] + (unsigned int)mailBoxes[decoded[pc+1].operand];
+	pc += 2;
+	in = decoded[pc];
+	goto op_sta;
+
+op_lda_sub_sta:
+	accumulator = (unsigned int)mailBoxes[in.operand] - (unsigned int)mailBoxes[decoded[pc+1].operand];
+	pc += 2;
+	in = decoded[pc];
+	goto op_sta;
+
+op_lda_sub_brz:
+	accumulator = (unsigned int)mailBoxes[in.operand] - (unsigned int)mailBoxes[decoded[pc+1].operand];
+	pc += 2;
+	in = decoded[pc];
+	goto op_brz;
+
+op_lda_sub_brp:
+	accumulator = (unsigned int)mailBoxes[in.operand] - (unsigned int)mailBoxes[decoded[pc+1].operand];
+	pc += 2;
+	in = decoded[pc];
+	goto op_brp;
+
+op_inp_sta:
+	{
+		code->accumulator = accumulator;
+		code->programCounter = pc;
+		if (!code->inpFunction)
+		{
+			ret = ERROR_NEED_INPUT;
+			goto refund;
+		}
+		int input;
+		if (!(*code->inpFunction)(&input, code->inputCtx))
+		{
+			ret = ERROR_BAD_INPUT;
+			goto refund;
+		}
+		accumulator = input;
+	}
+	++pc;
+	in = decoded[pc];
+	goto op_sta;
+
+op_hlt:
+	ret = ERROR_HALT;
+	goto refund;
+
+op_bad:
+	ret = ERROR_BAD_INSTRUCTION;
+	goto refund;
+
+op_bad_pc:
+	ret = ERROR_BAD_PC;
+	goto refund;
+
+#undef BACK_EDGE
+#undef BLOCK
+#undef DISPATCH
+
+tail:
+	// not enough budget for the whole block, so it's the last one. Step through what the budget covers
+	code->accumulator = accumulator;
+	code->programCounter = pc;
+	for (; remaining > 0; --remaining)
+	{
+		ret = Step(code);
+		if (ret != ERROR_OK) break;
+	}
+	if (ret == ERROR_OK) ret = ERROR_BUDGET_EXHAUSTED;
+	if (executed) *executed = maxSteps - remaining;
+	return ret;
+
+refund:
+	// the instruction at pc didn't complete, and nothing after it in the block ran
+	remaining += blockLength[pc];
+done:
+	code->accumulator = accumulator;
+	code->programCounter = pc;
+	if (executed) *executed = maxSteps - remaining;
+	return ret;
+}
+
+s8 RuntimeError_StrErrorArena(LMCContext* code, RuntimeError error, Arena* arena)
+{
+	buf buffer = bufFromArena(arena);
+
+	switch (error)
+	{
+		case ERROR_OK:
+			return (s8) { 0, 0 }; // no error to report
+		case ERROR_HALT:
 			break; // normal program termination
 		case ERROR_BAD_PC:
 			appends8(&buffer, S("Bad PC value "));
@@ -751,12 +1332,67 @@ s8 RuntimeError_StrError(LMCContext* code, RuntimeError error)
 			appends8(&buffer, S(" at "));
 			appendInteger(&buffer, code->programCounter);
 			break;
+		case ERROR_BUDGET_EXHAUSTED:
+			appends8(&buffer, S("Step limit reached at "));
+			appendInteger(&buffer, code->programCounter);
+			break;
+		case ERROR_INFINITE_LOOP:
+			appends8(&buffer, S("Infinite loop at "));
+			appendInteger(&buffer, code->programCounter);
+			break;
+		case ERROR_VALUE_OVERFLOW:
+			appends8(&buffer, S("Value "));
+			appendInteger(&buffer, (int)code->accumulator);
+			appends8(&buffer, S(" too large to store at "));
+			appendInteger(&buffer, code->programCounter);
+			break;
 		default:
 			break;
 	}
-	return bufTos8(&buffer);
+	return bufToArena(&buffer, arena);
+}
+
+s8 RuntimeError_StrError(LMCContext* code, RuntimeError error)
+{
+	static _Thread_local unsigned char mem[60];
+	Arena arena = { &mem[0], &mem[sizeof(mem)] };
+	return RuntimeError_StrErrorArena(code, error, &arena);
+}
+
+#include "lanes.c"
+#include "compact.c"
+#include "loops.c"
+#include "optimize.c"
+#include "trace.c"
+#include "history.c"
+#include "profile.c"
+#include "coverage.c"
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(LMC_NO_JIT)
+
+#include "jit_x64.c"
+
+#else
+
+// No JIT for this target, JitRun() just uses the interpreter
+
+LMCJit* JitCreate(void)
+{
+	return 0;
+}
+
+void JitDestroy(LMCJit* jit)
+{
+	(void) jit;
+}
+
+RuntimeError JitRun(LMCJit* jit, LMCContext* code, long maxSteps, long* executed)
+{
+	(void) jit;
+	return Run(code, maxSteps, executed);
 }
 
+#endif
 
 #ifdef TEST
 
@@ -765,6 +1401,32 @@ s8 RuntimeError_StrError(LMCContext* code, RuntimeError error)
 
 #define testcase(s1, s2) assert(s8Equal(s1, s2))
 
+static void DiscardOutput(unsigned char* str, ptrdiff_t len, void* ctx)
+{
+	(void) str; (void) len; (void) ctx;
+}
+
+typedef struct
+{
+	unsigned char bytes[4096];
+	ptrdiff_t len;
+} CapturedOutput;
+
+static void CaptureOutput(unsigned char* str, ptrdiff_t len, void* ctx)
+{
+	CapturedOutput* out = ctx;
+	for (ptrdiff_t i = 0; i < len && out->len < (ptrdiff_t)sizeof(out->bytes); ++i) out->bytes[out->len++] = str[i];
+}
+
+// Inputs 0, 1, 2... from a counter, until there have been 20
+static bool CountingInput(int* input, void* ctx)
+{
+	int* next = ctx;
+	if (*next == 20) return false;
+	*input = (*next)++;
+	return true;
+}
+
 int main(void)
 {
 	// Tests for GetLine
@@ -812,6 +1474,29 @@ int main(void)
 		testcase(StripComment(S("// ; comment # othercomment")), S(""));
 	}
 
+	// Tests for GetMnemonicValue - every combination of letters, against a plain list
+	{
+		const char* names[] = { "HLT", "COB", "ADD", "SUB", "STA", "STO", "LDA", "BRA", "BRZ", "BRP", "INP", "OUT", "OTC", "DAT" };
+		const int values[] = { 000, 000, 100, 200, 300, 300, 500, 600, 700, 800, 901, 902, 922, 1000 };
+		for (int a = 0; a < 52; ++a)
+		for (int b = 0; b < 52; ++b)
+		for (int c = 0; c < 52; ++c)
+		{
+			const char* letters = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+			unsigned char word[3] = { letters[a], letters[b], letters[c] };
+			int expected = -1;
+			for (int i = 0; i < 14; ++i)
+			{
+				if (s8iEqual((s8){ word, 3 }, (s8){ (unsigned char*)names[i], 3 })) expected = values[i];
+			}
+			assert(GetMnemonicValue((s8){ word, 3 }) == expected);
+		}
+		assert(GetMnemonicValue(S("")) == -1);
+		assert(GetMnemonicValue(S("ADDD")) == -1);
+		assert(GetMnemonicValue(S("AD")) == -1);
+		assert(GetMnemonicValue(S("AD\x04")) == -1);
+	}
+
 	// Tests for s8iEqual
 	{
 		assert(s8iEqual(S("Hi"), S("hi")));
@@ -819,6 +1504,803 @@ int main(void)
 		assert(s8iEqual(S("hi"), S("hi")));
 	}
 
+	// Tests for Assemble - forward references, and errors reported in the same order as the old two pass assembler
+	{
+		LMCContext code = {0};
+		assert(Assemble(S("BRA end\nend HLT\n"), &code, true).lineNumber == -1);
+		assert(code.mailBoxes[0] == 601);
+		assert(Assemble(S("BRA nowhere\nfoo bar\n"), &code, true).lineNumber == 2);
+		assert(Assemble(S("INP 5\nBRA nowhere\n"), &code, true).lineNumber == 1);
+		testcase(Assemble(S("BRA nowhere junk\n"), &code, true).message, S("undefined address label \"nowhere\""));
+		testcase(Assemble(S("BRA end junk\nend HLT"), &code, true).message, S("junk \"junk\" found after address"));
+	}
+
+	// Tests for AssembleLines - every mailbox knows the line it came from
+	{
+		LMCContext code = {0};
+		int lines[100];
+		s8 program = S(
+			"// comment\n"
+			"\n"
+			"start INP\n"
+			"      OUT // output\n"
+			"\n"
+			"      BRA start\n");
+		assert(AssembleLines(program, &code, true, 0, lines).lineNumber == -1);
+		assert(lines[0] == 3 && lines[1] == 4 && lines[2] == 6);
+		assert(lines[3] == 0 && lines[99] == 0);
+		assert(code.mailBoxes[2] == 600);
+	}
+
+	// Tests for AssembleArena - messages from one arena don't overwrite each other
+	{
+		unsigned char mem[256];
+		Arena arena = { &mem[0], &mem[sizeof(mem)] };
+		LMCContext code = {0};
+		AssemblerError first = AssembleArena(S("INP\nfoo\n"), &code, true, &arena);
+		AssemblerError second = AssembleArena(S("BRA nowhere\n"), &code, true, &arena);
+		assert(first.lineNumber == 2);
+		assert(second.lineNumber == 1);
+		testcase(first.message, S("unknown instruction \"foo\""));
+		testcase(second.message, S("undefined address label \"nowhere\""));
+		assert(arena.beg == mem + first.message.len + second.message.len);
+
+		Arena tiny = { &mem[0], &mem[7] };
+		testcase(AssembleArena(S("foo\n"), &code, true, &tiny).message, S("unknown"));
+	}
+
+	// Tests for Run - has to end in exactly the same state as stepping
+	{
+		// counts down to zero, then patches a HLT over the head of its own loop and branches back into it
+		s8 program = S(
+			"loop  LDA count\n"
+			"      SUB one\n"
+			"      STA count\n"
+			"      BRZ patch\n"
+			"      BRA loop\n"
+			"patch LDA halt\n"
+			"      STA loop\n"
+			"      BRA loop\n"
+			"count DAT 5\n"
+			"one   DAT 1\n"
+			"halt  DAT 0\n");
+
+		LMCContext a = {0};
+		LMCContext b = {0};
+		assert(Assemble(program, &a, true).lineNumber == -1);
+		b = a;
+
+		long steps = 0;
+		RuntimeError stepError;
+		while ((stepError = Step(&a)) == ERROR_OK) ++steps;
+
+		long executed = 0;
+		RuntimeError runError = Run(&b, 3, &executed);
+		assert(runError == ERROR_BUDGET_EXHAUSTED);
+		assert(executed == 3);
+		assert(b.programCounter == 3);
+
+		long rest = 0;
+		runError = Run(&b, -1, &rest);
+		assert(runError == stepError);
+		assert(runError == ERROR_HALT);
+		assert(executed + rest == steps);
+		assert(a.accumulator == b.accumulator);
+		assert(a.programCounter == b.programCounter);
+		assert(memcmp(a.mailBoxes, b.mailBoxes, sizeof(a.mailBoxes)) == 0);
+
+		LMCContext c = {0};
+		c.mailBoxes[0] = 450;
+		assert(Run(&c, -1, 0) == ERROR_BAD_INSTRUCTION);
+		c.mailBoxes[0] = -5;
+		assert(Run(&c, -1, 0) == ERROR_BAD_INSTRUCTION);
+		c.mailBoxes[0] = 1000;
+		assert(Run(&c, -1, 0) == ERROR_BAD_INSTRUCTION);
+		for (int i = 0; i < 100; ++i) c.mailBoxes[i] = 599; // LDA 99 everywhere, runs off the end
+		assert(Run(&c, -1, 0) == ERROR_BAD_PC);
+		assert(c.programCounter == 100);
+	}
+
+	// Tests for the Run budget and superinstructions - the budget is charged per block, but it has to stop
+	// on exactly the same instruction as stepping, including when STA moves block boundaries around or
+	// rewrites part of a fused sequence, and when a branch lands in the middle of one
+	{
+		// LDA/ADD/STA, LDA/SUB/STA, LDA/SUB/BRZ, LDA/SUB/BRP, INP/STA
+		static const int idioms[5][3] = { {5, 1, 3}, {5, 2, 3}, {5, 2, 7}, {5, 2, 8}, {9, 3, 0} };
+		unsigned int seed = 99;
+		for (int program = 0; program < 2000; ++program)
+		{
+			LMCContext a = {0};
+			for (int i = 0; i < 100; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				int op = (seed >> 16) % 10;
+				seed = seed*1103515245 + 12345;
+				int operand = (seed >> 16) % 100;
+				a.mailBoxes[i] = (op == 0 || op == 9) ? 500 + operand : op*100 + operand;
+			}
+			for (int k = 0; k < 20; ++k)
+			{
+				seed = seed*1103515245 + 12345;
+				int at = (seed >> 16) % 98;
+				const int* idiom = idioms[k % 5];
+				for (int j = 0; j < 3 && idiom[j]; ++j)
+				{
+					seed = seed*1103515245 + 12345;
+					a.mailBoxes[at + j] = idiom[j] == 9 ? 901 : idiom[j]*100 + (seed >> 16) % 100;
+				}
+			}
+			// values far outside what an LMC mailbox holds, so fused adds and subtracts wrap like the unfused ones
+			for (int k = 0; program % 2 && k < 20; ++k)
+			{
+				seed = seed*1103515245 + 12345;
+				int at = (seed >> 16) % 100;
+				seed = seed*1103515245 + 12345;
+				a.mailBoxes[at] = (int)(seed ^ (seed << 16));
+			}
+			a.outFunction = DiscardOutput; // STA can write an OUT
+			LMCContext b = a;
+			seed = seed*1103515245 + 12345;
+			long budget = (seed >> 16) % 500;
+
+			long ran = 0;
+			RuntimeError runError = Run(&a, budget, &ran);
+			long steps = 0;
+			RuntimeError stepError = ERROR_BUDGET_EXHAUSTED;
+			for (; steps < budget; ++steps)
+			{
+				RuntimeError error = Step(&b);
+				if (error == ERROR_OK) continue;
+				stepError = error;
+				break;
+			}
+			assert(runError == stepError);
+			assert(ran == steps);
+			assert(a.accumulator == b.accumulator);
+			assert(a.programCounter == b.programCounter);
+			assert(memcmp(a.mailBoxes, b.mailBoxes, sizeof(a.mailBoxes)) == 0);
+		}
+	}
+
+	// Tests for loop acceleration - counted loops skipped in closed form have to end up in exactly the state
+	// stepping gets to, with the same count, wherever the budget runs out. Loops it can't handle are mixed in
+	{
+		unsigned int seed = 4242;
+		for (int program = 0; program < 300; ++program)
+		{
+			LMCContext a = {0};
+			int at = 0;
+			seed = seed*1103515245 + 12345;
+			bool exitAtEnd = (seed >> 16) % 2;
+			seed = seed*1103515245 + 12345;
+			int statements = 1 + (seed >> 16) % 6;
+			seed = seed*1103515245 + 12345;
+			int testAt = exitAtEnd ? statements : (int)((seed >> 16) % (statements + 1));
+			int exit = 0;
+			for (int k = 0; k <= statements; ++k)
+			{
+				seed = seed*1103515245 + 12345;
+				int counter = 80 + (seed >> 16) % 5;
+				seed = seed*1103515245 + 12345;
+				int constant = 90 + (seed >> 16) % 10;
+				seed = seed*1103515245 + 12345;
+				int kind = (seed >> 16) % 8;
+				if (k == testAt)
+				{
+					a.mailBoxes[at++] = 500 + counter;
+					a.mailBoxes[at++] = 200 + constant;
+					exit = at;
+					a.mailBoxes[at++] = (kind % 2 ? 800 : 700);
+					if (k == statements) break;
+				}
+				else if (kind < 5)
+				{
+					a.mailBoxes[at++] = 500 + counter; // counter += constant
+					a.mailBoxes[at++] = (kind % 2 ? 200 : 100) + constant;
+					a.mailBoxes[at++] = 300 + counter;
+				}
+				else if (kind == 5)
+				{
+					a.mailBoxes[at++] = 500 + constant; // reset
+					a.mailBoxes[at++] = 300 + 85 + counter % 5;
+				}
+				else
+				{
+					a.mailBoxes[at++] = 500 + 85 + counter % 5; // adds one counter to another, not a counted loop
+					a.mailBoxes[at++] = 100 + counter;
+					a.mailBoxes[at++] = 300 + 85 + counter % 5;
+				}
+			}
+			if (exitAtEnd) a.mailBoxes[exit] += 0; // back to the top when taken
+			else
+			{
+				a.mailBoxes[exit] += at + 1;
+				a.mailBoxes[at++] = 600; // BRA 0
+			}
+			a.mailBoxes[at] = 0;
+			for (int i = 80; i < 100; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				int value = (int)((seed >> 16) % 21) - 10;
+				seed = seed*1103515245 + 12345;
+				if ((seed >> 16) % 8 == 0) value = (int)(seed * 2654435761u);
+				a.mailBoxes[i] = value;
+			}
+			LMCContext b = a;
+			seed = seed*1103515245 + 12345;
+			long budget = (seed >> 16) % 20000;
+
+			long ran = 0;
+			RuntimeError runError = Run(&a, budget, &ran);
+			long steps = 0;
+			RuntimeError stepError = ERROR_BUDGET_EXHAUSTED;
+			for (; steps < budget; ++steps)
+			{
+				RuntimeError error = Step(&b);
+				if (error == ERROR_OK) continue;
+				stepError = error;
+				break;
+			}
+			assert(runError == stepError);
+			assert(ran == steps);
+			assert(a.accumulator == b.accumulator);
+			assert(a.programCounter == b.programCounter);
+			assert(memcmp(a.mailBoxes, b.mailBoxes, sizeof(a.mailBoxes)) == 0);
+		}
+
+		// far too many iterations to step through: counts up by 3 until it wraps round to exactly zero
+		s8 program = S(
+			"loop  LDA sum\n"
+			"      ADD five\n"
+			"      STA sum\n"
+			"      LDA count\n"
+			"      ADD three\n"
+			"      STA count\n"
+			"      BRZ done\n"
+			"      BRA loop\n"
+			"done  HLT\n"
+			"sum   DAT\n"
+			"count DAT 1\n"
+			"three DAT 3\n"
+			"five  DAT 5\n");
+		LMCContext big = {0};
+		assert(Assemble(program, &big, true).lineNumber == -1);
+		long ran = 0;
+		assert(Run(&big, -1, &ran) == ERROR_HALT);
+		// 1 + 3k == 0 (mod 2^32) for k = 1431655765
+		long iterations = 1431655765L;
+		assert(ran == iterations*8 - 1);
+		assert(big.mailBoxes[9] == (int)(5u*(unsigned int)iterations));
+		assert(big.mailBoxes[10] == 0);
+		assert(big.accumulator == 0);
+	}
+
+	// Tests for OptimizeImage - the optimized image has to do the same I/O, in fewer steps where it can
+	{
+		s8 program = S(
+			"      INP\n"
+			"      STA x\n"
+			"      LDA x\n" // just stored
+			"      BRA a\n"
+			"a     BRA b\n" // chain
+			"b     OUT\n"
+			"      LDA zero\n"
+			"      BRZ c\n" // always taken
+			"      OUT\n"
+			"c     STA dead\n" // never read
+			"      ADD zero\n"
+			"      LDA x\n"
+			"      SUB one\n"
+			"      STA x\n"
+			"      BRP b\n"
+			"      HLT\n"
+			"x     DAT\n"
+			"one   DAT 1\n"
+			"zero  DAT 0\n"
+			"dead  DAT\n");
+		LMCContext a = {0};
+		assert(Assemble(program, &a, true).lineNumber == -1);
+		LMCContext b = a;
+		assert(OptimizeImage(&b));
+
+		CapturedOutput outA = {0};
+		CapturedOutput outB = {0};
+		int nextA = 5;
+		int nextB = 5;
+		a.inpFunction = b.inpFunction = CountingInput;
+		a.outFunction = b.outFunction = CaptureOutput;
+		a.inputCtx = &nextA;
+		a.outputCtx = &outA;
+		b.inputCtx = &nextB;
+		b.outputCtx = &outB;
+		long ranA = 0;
+		long ranB = 0;
+		assert(Run(&a, -1, &ranA) == ERROR_HALT);
+		assert(Run(&b, -1, &ranB) == ERROR_HALT);
+		assert(outA.len == outB.len && memcmp(outA.bytes, outB.bytes, outA.len) == 0);
+		assert(ranB < ranA);
+
+		// writes over its own code
+		LMCContext c = {0};
+		assert(Assemble(S("LDA h\nSTA 2\nBRA 0\nh DAT 0\n"), &c, true).lineNumber == -1);
+		LMCContext d = c;
+		assert(!OptimizeImage(&d));
+		assert(memcmp(&c, &d, sizeof(c)) == 0);
+
+		// random programs that stay inside their code, so most of them can be optimized
+		unsigned int seed = 777;
+		int optimized = 0;
+		for (int program = 0; program < 2000; ++program)
+		{
+			LMCContext x = {0};
+			seed = seed*1103515245 + 12345;
+			int length = 2 + (seed >> 16) % 30;
+			for (int i = 0; i < length; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				int kind = (seed >> 16) % 12;
+				seed = seed*1103515245 + 12345;
+				int data = 60 + (seed >> 16) % 8;
+				int target = (seed >> 20) % length;
+				static const int ops[12] = { 100, 200, 300, 300, 500, 500, 600, 700, 800, 901, 902, 0 };
+				int op = ops[kind];
+				if (op >= 900 || op == 0) x.mailBoxes[i] = op;
+				else x.mailBoxes[i] = op + (op >= 600 ? target : data);
+			}
+			x.mailBoxes[length-1] = 0;
+			for (int i = 60; i < 68; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				x.mailBoxes[i] = (int)((seed >> 16) % 5) - 2;
+			}
+			LMCContext y = x;
+			if (!OptimizeImage(&y)) continue;
+			++optimized;
+
+			CapturedOutput outX = {0};
+			CapturedOutput outY = {0};
+			int nextX = 0;
+			int nextY = 0;
+			x.inpFunction = y.inpFunction = CountingInput;
+			x.outFunction = y.outFunction = CaptureOutput;
+			x.inputCtx = &nextX;
+			x.outputCtx = &outX;
+			y.inputCtx = &nextY;
+			y.outputCtx = &outY;
+			long ranX = 0;
+			long ranY = 0;
+			RuntimeError errorX = Run(&x, 5000, &ranX);
+			RuntimeError errorY = Run(&y, 5000, &ranY);
+			assert(ranY <= ranX || errorX == ERROR_BUDGET_EXHAUSTED);
+			// a program that ran out of budget may have got further once optimized
+			if (errorX == ERROR_BUDGET_EXHAUSTED) continue;
+			assert(errorX == errorY);
+			assert(outX.len == outY.len && memcmp(outX.bytes, outY.bytes, outX.len) == 0);
+		}
+		assert(optimized > 1000);
+	}
+
+	// Tests for RunTraced - the ring keeps the last records, and they match stepping
+	{
+		LMCContext a = {0};
+		assert(Assemble(S("loop LDA n\nSUB one\nSTA n\nBRP loop\nHLT\nn DAT 9\none DAT 1\n"), &a, true).lineNumber == -1);
+		LMCContext b = a;
+		LMCTraceRecord records[8];
+		LMCTrace trace = { records, 8, 0 };
+		long ran = 0;
+		assert(RunTraced(&a, &trace, 5, &ran) == ERROR_BUDGET_EXHAUSTED);
+		assert(ran == 5 && trace.count == 5);
+		long rest = 0;
+		assert(RunTraced(&a, &trace, -1, &rest) == ERROR_HALT);
+		assert(trace.count == (unsigned long long)(ran + rest));
+
+		// replay by stepping, and check the records that are still in the ring
+		for (unsigned long long n = 0; n < trace.count; ++n)
+		{
+			int pc = b.programCounter;
+			int old = b.mailBoxes[5];
+			assert(Step(&b) == ERROR_OK);
+			if (n + 8 < trace.count) continue;
+			LMCTraceRecord* r = &records[n & 7];
+			assert(r->programCounter == pc);
+			assert(r->instruction == a.mailBoxes[pc]);
+			assert(r->accumulator == b.accumulator);
+			if (pc == 2) assert(r->written == 5 && r->overwritten == old);
+			else assert(r->written == LMC_TRACE_NO_WRITE);
+		}
+		assert(memcmp(a.mailBoxes, b.mailBoxes, sizeof(a.mailBoxes)) == 0);
+	}
+
+	// Tests for the undo history - going back to any step gives exactly the state stepping had there
+	{
+		static LMCContext states[301];
+		LMCUndoRecord undo[200];
+		LMCCheckpoint checkpoints[4];
+		unsigned int seed = 2024;
+		for (int program = 0; program < 200; ++program)
+		{
+			LMCContext a = {0};
+			for (int i = 0; i < 100; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				int op = (seed >> 16) % 10;
+				seed = seed*1103515245 + 12345;
+				int operand = (seed >> 16) % 100;
+				a.mailBoxes[i] = (op == 0 || op == 9) ? 300 + operand : op*100 + operand;
+			}
+			a.outFunction = DiscardOutput;
+			LMCHistory history;
+			HistoryInit(&history, undo, 200, checkpoints, 4, 32);
+
+			// states[n] is the state before step n
+			long steps = 0;
+			states[0] = a;
+			while (steps < 300 && StepRecorded(&a, &history) == ERROR_OK) states[++steps] = a;
+			assert(history.step == steps);
+			assert(history.oldest == (steps > 200 ? steps - 200 : 0));
+
+			for (int k = 0; k < 10; ++k)
+			{
+				seed = seed*1103515245 + 12345;
+				long target = history.oldest + (long)((seed >> 16) % (history.step - history.oldest + 1));
+				long back = history.step - target;
+				if (k % 2) assert(SeekHistory(&a, &history, target));
+				else assert(StepBack(&a, &history, back) == back);
+				assert(history.step == target);
+				assert(a.accumulator == states[target].accumulator);
+				assert(a.programCounter == states[target].programCounter);
+				assert(memcmp(a.mailBoxes, states[target].mailBoxes, sizeof(a.mailBoxes)) == 0);
+
+				// and forward again, which has to end up the same way
+				long forward = 0;
+				RunRecorded(&a, &history, steps - target, &forward);
+				assert(forward == steps - target && history.step == steps);
+				assert(memcmp(a.mailBoxes, states[steps].mailBoxes, sizeof(a.mailBoxes)) == 0);
+			}
+			assert(!SeekHistory(&a, &history, history.step + 1));
+			if (history.oldest > 0) assert(!SeekHistory(&a, &history, history.oldest - 1));
+		}
+	}
+
+	// Tests for RunProfiled - counts add up to the instructions run, and match stepping
+	{
+		LMCContext a = {0};
+		assert(Assemble(S("loop LDA n\nSUB one\nSTA n\nBRZ done\nBRA loop\ndone HLT\nn DAT 9\none DAT 1\n"), &a, true).lineNumber == -1);
+		LMCContext b = a;
+		LMCProfile profile = {0};
+		long ran = 0;
+		assert(RunProfiled(&a, &profile, -1, &ran) == ERROR_HALT);
+		assert(ran == 9*5 - 1);
+		assert(profile.executions[0] == 9 && profile.executions[4] == 8 && profile.executions[5] == 0);
+		assert(profile.taken[3] == 1 && profile.notTaken[3] == 8);
+		assert(profile.writes[6] == 9 && profile.writes[2] == 0);
+		long stepped = 0;
+		while (Step(&b) == ERROR_OK) ++stepped;
+		assert(stepped == ran && b.programCounter == a.programCounter);
+
+		// random programs, including ones that stop on bad instructions or write over their own code
+		unsigned int seed = 99;
+		for (int program = 0; program < 500; ++program)
+		{
+			LMCContext x = {0};
+			for (int i = 0; i < 100; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				int op = (seed >> 16) % 10;
+				seed = seed*1103515245 + 12345;
+				x.mailBoxes[i] = (op == 9 ? 902 : op*100) + (seed >> 16) % 100;
+			}
+			x.outFunction = DiscardOutput;
+			LMCContext y = x;
+			LMCProfile p = {0};
+			long n = 0;
+			RuntimeError errorX = RunProfiled(&x, &p, 1000, &n);
+
+			LMCProfile q = {0};
+			long m = 0;
+			RuntimeError errorY = ERROR_BUDGET_EXHAUSTED;
+			for (; m < 1000; ++m)
+			{
+				int pc = y.programCounter;
+				int instruction = (pc >= 0 && pc <= 99) ? y.mailBoxes[pc] : 0;
+				bool zero = y.accumulator == 0, positive = (int)y.accumulator >= 0;
+				errorY = Step(&y);
+				if (errorY != ERROR_OK) break;
+				errorY = ERROR_BUDGET_EXHAUSTED;
+				++q.executions[pc];
+				if (instruction / 100 == 3) ++q.writes[instruction % 100];
+				if (instruction / 100 == 7 || instruction / 100 == 8)
+				{
+					if (instruction / 100 == 7 ? zero : positive) ++q.taken[pc];
+					else ++q.notTaken[pc];
+				}
+			}
+			assert(errorX == errorY && n == m);
+			assert(x.accumulator == y.accumulator && x.programCounter == y.programCounter);
+			assert(memcmp(&p, &q, sizeof(p)) == 0);
+		}
+	}
+
+	// Tests for RunCovered - the same run as stepping, and the bits are exactly the mailboxes the PC reached
+	{
+		LMCContext a = {0};
+		assert(Assemble(S("INP\nBRZ zero\nOUT\nHLT\nzero LDA one\nOUT\nHLT\none DAT 1\n"), &a, true).lineNumber == -1);
+		a.outFunction = DiscardOutput;
+		LMCContext b = a;
+		LMCCoverage coverage = {0};
+		assert(RunCovered(&a, &coverage, -1, 0) == ERROR_NEED_INPUT);
+		assert(coverage.bits[0] == 1 && coverage.bits[1] == 0);
+		assert(ProvideInput(&a, 5) == ERROR_OK);
+		assert(RunCovered(&a, &coverage, -1, 0) == ERROR_HALT);
+		assert(coverage.bits[0] == 0xF);
+		assert(ProvideInput(&b, 0) == ERROR_OK);
+		assert(RunCovered(&b, &coverage, -1, 0) == ERROR_HALT);
+		assert(coverage.bits[0] == 0x7F);
+
+		unsigned int seed = 7;
+		for (int program = 0; program < 500; ++program)
+		{
+			LMCContext x = {0};
+			for (int i = 0; i < 100; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				int op = (seed >> 16) % 10;
+				seed = seed*1103515245 + 12345;
+				x.mailBoxes[i] = (op == 9 ? 902 : op*100) + (seed >> 16) % 100;
+			}
+			x.outFunction = DiscardOutput;
+			LMCContext y = x;
+			LMCCoverage c = {0};
+			long n = 0;
+			RuntimeError errorX = RunCovered(&x, &c, 1000, &n);
+
+			LMCCoverage d = {0};
+			long m = 0;
+			RuntimeError errorY = ERROR_BUDGET_EXHAUSTED;
+			for (; m < 1000; ++m)
+			{
+				int pc = y.programCounter;
+				errorY = Step(&y);
+				if (pc >= 0 && pc <= 99) d.bits[pc / 64] |= 1ull << (pc % 64);
+				if (errorY != ERROR_OK) break;
+				errorY = ERROR_BUDGET_EXHAUSTED;
+			}
+			assert(errorX == errorY && n == m);
+			assert(x.accumulator == y.accumulator && x.programCounter == y.programCounter);
+			assert(memcmp(x.mailBoxes, y.mailBoxes, sizeof(x.mailBoxes)) == 0);
+			assert(c.bits[0] == d.bits[0] && c.bits[1] == d.bits[1]);
+		}
+	}
+
+	// Tests for RunDetectLoops - a loop is only reported when the program really never stops
+	{
+		LMCContext spin = {0};
+		assert(Assemble(S("LDA 0\nLDA 0\nLDA 0\nBRA 0\n"), &spin, true).lineNumber == -1);
+		long ran = 0;
+		assert(RunDetectLoops(&spin, -1, &ran) == ERROR_INFINITE_LOOP);
+		assert(ran < 100);
+
+		unsigned int seed = 31337;
+		for (int program = 0; program < 2000; ++program)
+		{
+			LMCContext a = {0};
+			for (int i = 0; i < 100; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				int op = (seed >> 16) % 10;
+				seed = seed*1103515245 + 12345;
+				int operand = (seed >> 16) % 100;
+				a.mailBoxes[i] = (op == 0 || op == 9) ? 500 + operand : op*100 + operand;
+			}
+			a.outFunction = DiscardOutput;
+			LMCContext b = a;
+
+			long detected = 0;
+			RuntimeError error = RunDetectLoops(&a, 20000, &detected);
+			long executed = 0;
+			RuntimeError expected = Run(&b, 20000, &executed);
+			if (error == ERROR_INFINITE_LOOP)
+			{
+				assert(expected == ERROR_BUDGET_EXHAUSTED);
+				continue;
+			}
+			assert(error == expected);
+			assert(detected == executed);
+			assert(a.accumulator == b.accumulator);
+			assert(a.programCounter == b.programCounter);
+			assert(memcmp(a.mailBoxes, b.mailBoxes, sizeof(a.mailBoxes)) == 0);
+		}
+	}
+
+	// Tests for ProvideInput - with no input callback every engine parks on the INP and resumes from it
+	{
+		s8 program = S(
+			"      INP\n"
+			"      STA x\n"
+			"      INP\n"
+			"      ADD x\n"
+			"      HLT\n"
+			"x     DAT\n");
+		LMCContext base = {0};
+		assert(Assemble(program, &base, true).lineNumber == -1);
+		LMCJit* jit = JitCreate();
+
+		for (int engine = 0; engine < 4; ++engine)
+		{
+			LMCContext x = base;
+			LMCCompactContext compact;
+			LMCRunner runner = {0};
+			assert(CompactContext(&compact, &x));
+
+			int inputs[] = { 30, 12 };
+			int expectedPc[] = { 0, 2 };
+			for (int i = 0; i < 2; ++i)
+			{
+				RuntimeError error;
+				long ran = 0;
+				if (engine == 0) while ((error = Step(&x)) == ERROR_OK) {}
+				else if (engine == 1) error = Run(&x, -1, &ran);
+				else if (engine == 2) error = JitRun(jit, &x, -1, &ran);
+				else
+				{
+					error = RunCompact(&runner, &compact, -1, &ran);
+					ExpandContext(&x, &compact, &runner);
+				}
+				assert(error == ERROR_NEED_INPUT);
+				assert(x.programCounter == expectedPc[i]);
+				if (engine != 0) assert(ran == (i == 0 ? 0 : 1));
+
+				if (engine == 3) assert(ProvideInputCompact(&compact, inputs[i]) == ERROR_OK);
+				else assert(ProvideInput(&x, inputs[i]) == ERROR_OK);
+			}
+
+			if (engine == 3)
+			{
+				assert(RunCompact(&runner, &compact, -1, 0) == ERROR_HALT);
+				ExpandContext(&x, &compact, &runner);
+			}
+			else assert(Run(&x, -1, 0) == ERROR_HALT);
+			assert(x.accumulator == 42);
+			assert(x.programCounter == 4);
+			assert(ProvideInput(&x, 1) == ERROR_BAD_INSTRUCTION);
+		}
+		JitDestroy(jit);
+	}
+
+	// Tests for JitRun - random images have to end in the same state as with Run, including
+	// images that write over their own code
+	{
+		LMCJit* jit = JitCreate();
+		unsigned int seed = 12345;
+		for (int program = 0; program < 2000; ++program)
+		{
+			LMCContext a = {0};
+			for (int i = 0; i < 100; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				int op = (seed >> 16) % 10;
+				seed = seed*1103515245 + 12345;
+				int operand = (seed >> 16) % 100;
+				// no INP/OUT/OTC here, the callbacks are null
+				a.mailBoxes[i] = (op == 0 || op == 9) ? 500 + operand : op*100 + operand;
+			}
+			a.mailBoxes[99] = 0;
+			LMCContext b = a;
+
+			long ranA = 0;
+			long ranB = 0;
+			RuntimeError errorA = Run(&a, 20000, &ranA);
+			RuntimeError errorB = JitRun(jit, &b, 20000, &ranB);
+			assert(errorA == errorB);
+			assert(ranA == ranB);
+			assert(a.accumulator == b.accumulator);
+			assert(a.programCounter == b.programCounter);
+			assert(memcmp(a.mailBoxes, b.mailBoxes, sizeof(a.mailBoxes)) == 0);
+		}
+		JitDestroy(jit);
+	}
+
+	// Tests for RunLanes - every lane has to end like it would with Run on its own, even when
+	// the lanes diverge, write over their code, or stop at different times
+	{
+		unsigned int seed = 777;
+		for (int program = 0; program < 500; ++program)
+		{
+			LMCContext base = {0};
+			for (int i = 0; i < 100; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				int op = (seed >> 16) % 10;
+				seed = seed*1103515245 + 12345;
+				int operand = (seed >> 16) % 100;
+				base.mailBoxes[i] = (op == 0 || op == 9) ? 500 + operand : op*100 + operand;
+			}
+
+			LMCLanes lanes;
+			LanesLoad(&lanes, &base, LMC_LANES - program % 3);
+			LMCContext single[LMC_LANES];
+			for (int lane = 0; lane < lanes.laneCount; ++lane)
+			{
+				// a different "input" per lane, so they take different paths
+				lanes.mailBoxes[90 + lane][lane] = lane * 37 - 100;
+				LanesGet(&lanes, lane, &single[lane]);
+			}
+
+			RunLanes(&lanes, 5000);
+			for (int lane = 0; lane < lanes.laneCount; ++lane)
+			{
+				long executed = 0;
+				RuntimeError error = Run(&single[lane], 5000, &executed);
+				LMCContext got;
+				LanesGet(&lanes, lane, &got);
+				assert(error == lanes.status[lane]);
+				assert(executed == lanes.executed[lane]);
+				assert(got.accumulator == single[lane].accumulator);
+				assert(got.programCounter == single[lane].programCounter);
+				assert(memcmp(got.mailBoxes, single[lane].mailBoxes, sizeof(got.mailBoxes)) == 0);
+			}
+		}
+	}
+
+	// Tests for RunCompact - same result as Run, up to the first STA that doesn't fit in 16 bits
+	{
+		LMCRunner runner = {0};
+		unsigned int seed = 4242;
+		for (int program = 0; program < 500; ++program)
+		{
+			LMCContext a = {0};
+			for (int i = 0; i < 100; ++i)
+			{
+				seed = seed*1103515245 + 12345;
+				int op = (seed >> 16) % 10;
+				seed = seed*1103515245 + 12345;
+				int operand = (seed >> 16) % 100;
+				a.mailBoxes[i] = (op == 0 || op == 9) ? 500 + operand : op*100 + operand;
+			}
+
+			LMCCompactContext compact;
+			assert(CompactContext(&compact, &a));
+			long ranCompact = 0;
+			RuntimeError errorCompact = RunCompact(&runner, &compact, 20000, &ranCompact);
+
+			long ran = 0;
+			RuntimeError error = Run(&a, ranCompact, &ran);
+			assert(ran == ranCompact);
+			if (errorCompact == ERROR_VALUE_OVERFLOW)
+			{
+				assert(error == ERROR_BUDGET_EXHAUSTED);
+				assert(a.mailBoxes[a.programCounter] / 100 == 3);
+				assert((int)a.accumulator < SHRT_MIN || (int)a.accumulator > SHRT_MAX);
+			}
+			else if (errorCompact != ERROR_BUDGET_EXHAUSTED)
+			{
+				assert(Run(&a, 1, 0) == errorCompact);
+			}
+
+			LMCContext expanded;
+			ExpandContext(&expanded, &compact, &runner);
+			assert(expanded.accumulator == a.accumulator);
+			assert(expanded.programCounter == a.programCounter);
+			assert(memcmp(expanded.mailBoxes, a.mailBoxes, sizeof(a.mailBoxes)) == 0);
+		}
+
+		LMCContext big = {0};
+		big.mailBoxes[50] = 40000;
+		LMCCompactContext compact;
+		assert(!CompactContext(&compact, &big));
+
+		LMCCompactContext memory[3];
+		LMCCompactPool pool;
+		CompactPoolInit(&pool, memory, 3);
+		LMCCompactContext* x = CompactPoolAlloc(&pool);
+		LMCCompactContext* y = CompactPoolAlloc(&pool);
+		LMCCompactContext* z = CompactPoolAlloc(&pool);
+		assert(x && y && z && pool.used == 3);
+		assert(!CompactPoolAlloc(&pool));
+		CompactPoolFree(&pool, y);
+		assert(CompactPoolAlloc(&pool) == y);
+	}
+
 	// Tests for s8ToInteger
 	{
 		for (int i = -999; i < 1000; ++i)
@@ -0,0 +1,158 @@
+// Infinite loop detection, included from lmc.c
+// Between two INPs the machine is deterministic, so if its whole state (mailboxes, accumulator, PC) ever
+// repeats it will repeat forever. The state is hashed incrementally - mailboxes are XORed in one at a time
+// Zobrist style, so an STA only swaps out the old value - and Brent's algorithm looks for a repeat:
+// the state is saved at every power of two steps, and each step is compared against the saved one.
+// A hash match is confirmed against the full saved state, so a reported loop is never a collision.
+
+static unsigned long long StateHash(int slot, unsigned int value)
+{
+	// splitmix64 finalizer
+	unsigned long long x = (unsigned long long)slot << 32 | value;
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+// slots past the mailboxes for the registers
+#define HASH_ACCUMULATOR 100
+#define HASH_PC 101
+
+typedef struct
+{
+	int mailBoxes[100];
+	unsigned int accumulator;
+	int programCounter;
+	unsigned long long hash;
+} SavedState;
+
+static bool SameState(const SavedState* saved, const int* mailBoxes, unsigned int accumulator, int pc)
+{
+	if (accumulator != saved->accumulator || pc != saved->programCounter) return false;
+	for (int i = 0; i < 100; ++i)
+	{
+		if (mailBoxes[i] != saved->mailBoxes[i]) return false;
+	}
+	return true;
+}
+
+static void SaveState(SavedState* saved, const int* mailBoxes, unsigned int accumulator, int pc, unsigned long long hash)
+{
+	for (int i = 0; i < 100; ++i) saved->mailBoxes[i] = mailBoxes[i];
+	saved->accumulator = accumulator;
+	saved->programCounter = pc;
+	saved->hash = hash;
+}
+
+RuntimeError RunDetectLoops(LMCContext* code, long maxSteps, long* executed)
+{
+	assert(code);
+	if (maxSteps < 0) maxSteps = LONG_MAX;
+
+	int* mailBoxes = code->mailBoxes;
+	unsigned int accumulator = code->accumulator;
+	int pc = code->programCounter;
+	long count = 0;
+	RuntimeError ret = ERROR_BUDGET_EXHAUSTED;
+
+	unsigned long long memoryHash = 0;
+	for (int i = 0; i < 100; ++i) memoryHash ^= StateHash(i, mailBoxes[i]);
+
+	// Brent: the saved state moves up to the current one whenever steps reaches power
+	SavedState saved;
+	SaveState(&saved, mailBoxes, accumulator, pc,
+		memoryHash ^ StateHash(HASH_ACCUMULATOR, accumulator) ^ StateHash(HASH_PC, pc));
+	long power = 1;
+	long steps = 0; // since the state was saved
+
+	for (; count < maxSteps; ++count)
+	{
+		if (pc > 99 || pc < 0)
+		{
+			ret = ERROR_BAD_PC;
+			break;
+		}
+
+		DecodedInstruction in = Decode(mailBoxes[pc]);
+		bool gotInput = false;
+		if (in.op == OP_HLT)
+		{
+			ret = ERROR_HALT;
+			break;
+		}
+		else if (in.op == OP_ADD) accumulator += mailBoxes[in.operand];
+		else if (in.op == OP_SUB) accumulator -= mailBoxes[in.operand];
+		else if (in.op == OP_STA)
+		{
+			memoryHash ^= StateHash(in.operand, mailBoxes[in.operand]) ^ StateHash(in.operand, accumulator);
+			mailBoxes[in.operand] = accumulator;
+		}
+		else if (in.op == OP_LDA) accumulator = mailBoxes[in.operand];
+		else if (in.op == OP_BRA || in.op == OP_BRZ || in.op == OP_BRP)
+		{
+			bool taken = in.op == OP_BRA || (in.op == OP_BRZ ? accumulator == 0 : (int)accumulator >= 0);
+			if (taken) pc = in.operand - 1; // undo the increment below
+		}
+		else if (in.op == OP_INP)
+		{
+			code->accumulator = accumulator;
+			code->programCounter = pc;
+			if (!code->inpFunction)
+			{
+				ret = ERROR_NEED_INPUT;
+				break;
+			}
+			int input;
+			if (!(*code->inpFunction)(&input, code->inputCtx))
+			{
+				ret = ERROR_BAD_INPUT;
+				break;
+			}
+			accumulator = input;
+			gotInput = true;
+		}
+		// output doesn't feed back into the state, a program printing the same thing forever is still stuck
+		else if (in.op == OP_OUT || in.op == OP_OTC)
+		{
+			code->accumulator = accumulator;
+			code->programCounter = pc;
+			if (in.op == OP_OUT) OutputInteger(code, accumulator);
+			else OutputChar(code, accumulator);
+		}
+		else
+		{
+			ret = ERROR_BAD_INSTRUCTION;
+			break;
+		}
+		++pc;
+
+		unsigned long long hash = memoryHash ^ StateHash(HASH_ACCUMULATOR, accumulator) ^ StateHash(HASH_PC, pc);
+		if (gotInput)
+		{
+			// what happens next depends on the input, so earlier states prove nothing
+			SaveState(&saved, mailBoxes, accumulator, pc, hash);
+			power = 1;
+			steps = 0;
+			continue;
+		}
+
+		if (hash == saved.hash && SameState(&saved, mailBoxes, accumulator, pc))
+		{
+			++count;
+			ret = ERROR_INFINITE_LOOP;
+			break;
+		}
+		if (++steps == power)
+		{
+			SaveState(&saved, mailBoxes, accumulator, pc, hash);
+			power *= 2;
+			steps = 0;
+		}
+	}
+
+	code->accumulator = accumulator;
+	code->programCounter = pc;
+	if (executed) *executed = count;
+	return ret;
+}
@@ -0,0 +1,291 @@
+// Image optimizer, included from lmc.c
+// Rewrites an assembled image into one that does the same I/O in fewer steps. Instructions that can't
+// change anything become no-ops: an LDA of what the accumulator already holds (right after an STA of the
+// same mailbox, or a constant it already equals), an STA to a mailbox nothing reads, branches on an
+// accumulator that's known at that point. Branches to branches jump straight to the end of the chain.
+// LMC has no NOP, so the no-ops are then taken out by packing the rest of the program together and
+// renumbering every operand, with the data moved after the code.
+// All of that relies on knowing which mailboxes are code, so any program where an STA can reach
+// code, code is read as data, or execution can run into a bad instruction or off the end is left alone.
+
+typedef struct
+{
+	bool visited;
+	bool known; // accumulator is value on every path here
+	unsigned int value;
+	bool equal[100]; // mailboxes that hold the same as the accumulator on every path here
+} AccumulatorFacts;
+
+// Combines facts from another path into a mailbox's, returns true if they changed
+static bool MergeFacts(AccumulatorFacts* into, const AccumulatorFacts* from)
+{
+	if (!into->visited)
+	{
+		*into = *from;
+		return true;
+	}
+	bool changed = false;
+	if (into->known && (!from->known || from->value != into->value))
+	{
+		into->known = false;
+		changed = true;
+	}
+	for (int i = 0; i < 100; ++i)
+	{
+		if (into->equal[i] && !from->equal[i])
+		{
+			into->equal[i] = false;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// What an optimized mailbox turns into
+#define OPT_DROP 0 // unreachable, or data nothing uses
+#define OPT_KEEP 1
+#define OPT_NOP 2 // reached, but does nothing - execution carries on at the next mailbox
+
+// Next mailbox from at that does something, following no-ops
+static int SkipNops(const unsigned char* fate, int at)
+{
+	while (at < 100 && fate[at] == OPT_NOP) ++at;
+	return at;
+}
+
+bool OptimizeImage(LMCContext* code)
+{
+	assert(code);
+	int* mailBoxes = code->mailBoxes;
+	int entry = code->programCounter;
+	if (entry < 0 || entry > 99) return false;
+
+	DecodedInstruction in[100];
+	for (int i = 0; i < 100; ++i) in[i] = Decode(mailBoxes[i]);
+
+	// what is code, and what the code reads and writes
+	bool reached[100] = {0};
+	bool read[100] = {0};
+	bool written[100] = {0};
+	int stack[100];
+	int top = 0;
+	stack[top++] = entry;
+	reached[entry] = true;
+	while (top)
+	{
+		int i = stack[--top];
+		int next[2];
+		int count = 0;
+		switch (in[i].op)
+		{
+			case OP_HLT: break;
+			case OP_BAD: return false; // the error message would give a PC that's moved
+			case OP_ADD: case OP_SUB: case OP_LDA: read[in[i].operand] = true; next[count++] = i+1; break;
+			case OP_STA: written[in[i].operand] = true; next[count++] = i+1; break;
+			case OP_BRA: next[count++] = in[i].operand; break;
+			case OP_BRZ: case OP_BRP: next[count++] = in[i].operand; next[count++] = i+1; break;
+			default: next[count++] = i+1; break; // I/O
+		}
+		for (int k = 0; k < count; ++k)
+		{
+			if (next[k] > 99) return false; // same for running off the end
+			if (reached[next[k]]) continue;
+			reached[next[k]] = true;
+			stack[top++] = next[k];
+		}
+	}
+	for (int i = 0; i < 100; ++i)
+	{
+		if (reached[i] && (read[i] || written[i])) return false;
+	}
+
+	// Forward dataflow for the accumulator, to a fixed point. Mailboxes no STA writes are constants.
+	// A branch on a known accumulator only goes one way, so the other side isn't reached from there
+	AccumulatorFacts facts[100];
+	for (int i = 0; i < 100; ++i) facts[i].visited = false;
+	AccumulatorFacts start = { true, true, code->accumulator, {0} };
+	MergeFacts(&facts[entry], &start);
+	top = 0;
+	stack[top++] = entry;
+	bool queued[100] = {0};
+	queued[entry] = true;
+	while (top)
+	{
+		int i = stack[--top];
+		queued[i] = false;
+		AccumulatorFacts out = facts[i];
+		int m = in[i].operand;
+		int next[2];
+		int count = 0;
+		switch (in[i].op)
+		{
+			case OP_LDA:
+				out.known = !written[m];
+				out.value = mailBoxes[m];
+				for (int k = 0; k < 100; ++k) out.equal[k] = false;
+				out.equal[m] = true;
+				next[count++] = i+1;
+				break;
+			case OP_ADD:
+			case OP_SUB:
+				if (!written[m] && mailBoxes[m] == 0)
+				{
+					next[count++] = i+1;
+					break;
+				}
+				if (out.known && !written[m])
+					out.value = in[i].op == OP_ADD ? out.value + mailBoxes[m] : out.value - mailBoxes[m];
+				else out.known = false;
+				for (int k = 0; k < 100; ++k) out.equal[k] = false;
+				next[count++] = i+1;
+				break;
+			case OP_STA:
+				out.equal[m] = true;
+				next[count++] = i+1;
+				break;
+			case OP_INP:
+				out.known = false;
+				for (int k = 0; k < 100; ++k) out.equal[k] = false;
+				next[count++] = i+1;
+				break;
+			case OP_BRA: next[count++] = m; break;
+			case OP_BRZ:
+			case OP_BRP:
+			{
+				bool taken = in[i].op == OP_BRZ ? out.value == 0 : (int)out.value >= 0;
+				if (!out.known || taken) next[count++] = m;
+				if (!out.known || !taken) next[count++] = i+1;
+				break;
+			}
+			case OP_HLT: break;
+			default: next[count++] = i+1; break; // output
+		}
+		for (int k = 0; k < count; ++k)
+		{
+			if (MergeFacts(&facts[next[k]], &out) && !queued[next[k]])
+			{
+				queued[next[k]] = true;
+				stack[top++] = next[k];
+			}
+		}
+	}
+
+	// decide what each instruction becomes
+	unsigned char fate[100] = {0};
+	for (int i = 0; i < 100; ++i)
+	{
+		if (!facts[i].visited) continue;
+		const AccumulatorFacts* f = &facts[i];
+		int m = in[i].operand;
+		fate[i] = OPT_KEEP;
+		switch (in[i].op)
+		{
+			case OP_LDA:
+				if (f->equal[m] || (f->known && !written[m] && (unsigned int)mailBoxes[m] == f->value)) fate[i] = OPT_NOP;
+				break;
+			case OP_ADD:
+			case OP_SUB:
+				if (!written[m] && mailBoxes[m] == 0) fate[i] = OPT_NOP;
+				break;
+			case OP_STA:
+				if (!read[m] || f->equal[m]) fate[i] = OPT_NOP; // dead, or already holds it
+				break;
+			case OP_BRZ:
+			case OP_BRP:
+				if (f->known)
+				{
+					bool taken = in[i].op == OP_BRZ ? f->value == 0 : (int)f->value >= 0;
+					if (taken) in[i].op = OP_BRA;
+					else fate[i] = OPT_NOP;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+
+	// Thread branches through chains. A conditional branch can also pass through a conditional branch
+	// that has to go the same way: the accumulator hasn't changed, and zero is never negative
+	for (int i = 0; i < 100; ++i)
+	{
+		if (fate[i] != OPT_KEEP || (in[i].op != OP_BRA && in[i].op != OP_BRZ && in[i].op != OP_BRP)) continue;
+		int target = SkipNops(fate, in[i].operand);
+		for (int hops = 0; hops < 100; ++hops)
+		{
+			unsigned char op = in[target].op;
+			bool follows = op == OP_BRA ||
+				(op == OP_BRZ && in[i].op == OP_BRZ) ||
+				(op == OP_BRP && in[i].op != OP_BRA);
+			if (!follows) break;
+			target = SkipNops(fate, in[target].operand);
+		}
+		in[i].operand = (unsigned char)target;
+		if (in[i].op == OP_BRA && target == SkipNops(fate, i+1)) fate[i] = OPT_NOP;
+	}
+	// a BRA that became a no-op can be the end of another chain, so resolve targets again
+	for (int i = 0; i < 100; ++i)
+	{
+		if (fate[i] == OPT_KEEP && (in[i].op == OP_BRA || in[i].op == OP_BRZ || in[i].op == OP_BRP))
+			in[i].operand = (unsigned char)SkipNops(fate, in[i].operand);
+	}
+
+	// what's still reachable and still used after all that
+	bool live[100] = {0};
+	bool data[100] = {0};
+	top = 0;
+	entry = SkipNops(fate, entry);
+	stack[top++] = entry;
+	live[entry] = true;
+	while (top)
+	{
+		int i = stack[--top];
+		int next[2];
+		int count = 0;
+		switch (in[i].op)
+		{
+			case OP_HLT: break;
+			case OP_ADD: case OP_SUB: case OP_LDA: case OP_STA: data[in[i].operand] = true; next[count++] = i+1; break;
+			case OP_BRA: next[count++] = in[i].operand; break;
+			case OP_BRZ: case OP_BRP: next[count++] = in[i].operand; next[count++] = i+1; break;
+			default: next[count++] = i+1; break;
+		}
+		for (int k = 0; k < count; ++k)
+		{
+			int n = SkipNops(fate, next[k]);
+			if (live[n]) continue;
+			live[n] = true;
+			stack[top++] = n;
+		}
+	}
+
+	// pack code then data, in their original order so fall through still lands on the right instruction
+	int address[100];
+	int used = 0;
+	for (int i = 0; i < 100; ++i)
+	{
+		if (live[i]) address[i] = used++;
+	}
+	for (int i = 0; i < 100; ++i)
+	{
+		if (data[i]) address[i] = used++;
+	}
+
+	static const int opcodes[OP_COUNT] = {
+		[OP_ADD] = 100, [OP_SUB] = 200, [OP_STA] = 300, [OP_LDA] = 500,
+		[OP_BRA] = 600, [OP_BRZ] = 700, [OP_BRP] = 800,
+	};
+	int packed[100] = {0};
+	for (int i = 0; i < 100; ++i)
+	{
+		if (data[i]) packed[address[i]] = mailBoxes[i];
+		if (!live[i]) continue;
+		switch (in[i].op)
+		{
+			case OP_HLT: case OP_INP: case OP_OUT: case OP_OTC: packed[address[i]] = mailBoxes[i]; break;
+			default: packed[address[i]] = opcodes[in[i].op] + address[in[i].operand]; break;
+		}
+	}
+	for (int i = 0; i < 100; ++i) mailBoxes[i] = packed[i];
+	code->programCounter = address[entry];
+	return true;
+}
@@ -0,0 +1,86 @@
+// Execution profiling, included from lmc.c
+// A plain decode-and-dispatch loop like RunDetectLoops() with a few counter increments on the side.
+// Only instructions that complete are counted, so the executions always add up to *executed.
+
+RuntimeError RunProfiled(LMCContext* code, LMCProfile* profile, long maxSteps, long* executed)
+{
+	assert(code && profile);
+	if (maxSteps < 0) maxSteps = LONG_MAX;
+
+	int* mailBoxes = code->mailBoxes;
+	unsigned int accumulator = code->accumulator;
+	int pc = code->programCounter;
+	long count = 0;
+	RuntimeError ret = ERROR_BUDGET_EXHAUSTED;
+
+	for (; count < maxSteps; ++count)
+	{
+		if (pc > 99 || pc < 0)
+		{
+			ret = ERROR_BAD_PC;
+			break;
+		}
+
+		DecodedInstruction in = Decode(mailBoxes[pc]);
+		int next = pc + 1;
+		if (in.op == OP_HLT)
+		{
+			ret = ERROR_HALT;
+			break;
+		}
+		else if (in.op == OP_ADD) accumulator += mailBoxes[in.operand];
+		else if (in.op == OP_SUB) accumulator -= mailBoxes[in.operand];
+		else if (in.op == OP_STA)
+		{
+			mailBoxes[in.operand] = accumulator;
+			++profile->writes[in.operand];
+		}
+		else if (in.op == OP_LDA) accumulator = mailBoxes[in.operand];
+		else if (in.op == OP_BRA) next = in.operand;
+		else if (in.op == OP_BRZ || in.op == OP_BRP)
+		{
+			if (in.op == OP_BRZ ? accumulator == 0 : (int)accumulator >= 0)
+			{
+				next = in.operand;
+				++profile->taken[pc];
+			}
+			else ++profile->notTaken[pc];
+		}
+		else if (in.op == OP_INP)
+		{
+			code->accumulator = accumulator;
+			code->programCounter = pc;
+			if (!code->inpFunction)
+			{
+				ret = ERROR_NEED_INPUT;
+				break;
+			}
+			int input;
+			if (!(*code->inpFunction)(&input, code->inputCtx))
+			{
+				ret = ERROR_BAD_INPUT;
+				break;
+			}
+			accumulator = input;
+		}
+		else if (in.op == OP_OUT || in.op == OP_OTC)
+		{
+			code->accumulator = accumulator;
+			code->programCounter = pc;
+			if (in.op == OP_OUT) OutputInteger(code, accumulator);
+			else OutputChar(code, accumulator);
+		}
+		else
+		{
+			ret = ERROR_BAD_INSTRUCTION;
+			break;
+		}
+		++profile->executions[pc];
+		pc = next;
+	}
+
+	code->accumulator = accumulator;
+	code->programCounter = pc;
+	if (executed) *executed = count;
+	return ret;
+}
@@ -0,0 +1,48 @@
+// Execution tracing, included from lmc.c
+// Built on Step(), so a trace always shows exactly what stepping does, at the price of giving up Run()'s
+// fast paths: a traced run costs a Step() and a 16 byte store per instruction. The record is filled in
+// on the side and only goes into the ring once the instruction completed, so a failed one never
+// overwrites the oldest record.
+
+RuntimeError RunTraced(LMCContext* code, LMCTrace* trace, long maxSteps, long* executed)
+{
+	assert(code && trace && trace->records);
+	assert(trace->capacity && !(trace->capacity & (trace->capacity - 1)));
+	if (maxSteps < 0) maxSteps = LONG_MAX;
+
+	LMCTraceRecord* records = trace->records;
+	unsigned long long mask = trace->capacity - 1;
+	unsigned long long count = trace->count;
+	long steps = 0;
+	RuntimeError ret = ERROR_BUDGET_EXHAUSTED;
+
+	for (; steps < maxSteps; ++steps)
+	{
+		LMCTraceRecord record = { 0, LMC_TRACE_NO_WRITE, 0, 0, 0, 0 };
+		int pc = code->programCounter;
+		if (pc >= 0 && pc <= 99)
+		{
+			record.programCounter = (unsigned char)pc;
+			record.instruction = code->mailBoxes[pc];
+			if (record.instruction >= 300 && record.instruction < 400)
+			{
+				record.written = (unsigned char)(record.instruction - 300);
+				record.overwritten = code->mailBoxes[record.written];
+			}
+		}
+
+		RuntimeError error = Step(code);
+		if (error != ERROR_OK)
+		{
+			ret = error;
+			break;
+		}
+		record.accumulator = code->accumulator;
+		records[count & mask] = record;
+		++count;
+	}
+
+	trace->count = count;
+	if (executed) *executed = steps;
+	return ret;
+}